@@ -21,6 +21,35 @@
 //
 // If you play the scenario for a while and learn the sequence of the cards,
 // you can add them at the end.
+//
+// The simulation budget and the seeds can be changed with flags, run with
+// --help for the list. With --ci_width the number of boards adapts to how
+// quickly the likelihood estimate converges. When the hidden cards can be
+// dealt in at most --boards ways, each way is evaluated once instead; with an
+// exhaustive search (--engine=beam --beam_width=0) the likelihood is then
+// exact.
+//
+// With --batch, the input may hold many scenarios separated by lines starting
+// with "---". They share one pool of worker threads and get one result line
+// each, or an error line for a scenario that cannot be read. --format=json
+// switches all output to JSON lines for other tools.
+//
+// --serve=PATH keeps the process, its card tables and worker threads running
+// and evaluates batches of scenarios sent over the Unix socket PATH (or stdin
+// with --serve=-), replying with JSON lines as boards complete. Each scenario
+// must end with a "---" line. A client that sends the next scenario, or hangs
+// up, before the result of the current one cancels it; the result then covers
+// the boards done so far and says "cancelled":true.
+//
+// Built with -DSPLENDOR_NO_MAIN, the file can be included in other programs,
+// which run estimates in the background with AsyncEstimate.
+//
+// --bench times the simulation and annealing hot paths on the first board of
+// the scenario, run it on the sample input above to compare builds.
+//
+// Boards and their annealing restarts are evaluated in parallel on all
+// available cores. Build with:
+// g++ -O2 -std=c++11 -pthread splendor.cc -o splendor
 
 
 
@@ -28,13 +57,30 @@
 #include "splendor_cards.h"
 
 #include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
 #include <cmath>
+#include <cstdarg>
+#include <condition_variable>
+#include <csignal>
+#include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
-#include <set>
-#include <sstream>
+#include <deque>
+#include <fcntl.h>
+#include <functional>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
 #include <vector>
 
 using namespace std;
@@ -114,9 +160,95 @@ struct Twister {
   int ptr_;
 };
 
+// Finalizer of splitmix64, a bijection that scrambles every input bit into
+// every output bit.
+uint64_t mix64(uint64_t z) {
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  return z ^ (z >> 31);
+}
+
+// xoshiro256** generator with the same interface as Twister. Its whole state
+// is four words, against 2.5 KB for the Twister, and every number costs a
+// handful of register operations instead of a periodic 624-word refill.
+struct Xoshiro {
+  void init(int seed) {
+    // Expand the seed with splitmix64, as recommended by the authors.
+    uint64_t x = (uint32_t)seed;
+    for (int i = 0; i < 4; ++i) s_[i] = mix64(x += 0x9E3779B97F4A7C15ULL);
+  }
+
+  Xoshiro() {
+    init(0);
+  }
+
+  float next_float() {
+    return (next() >> 40) * (1.0f / 16777216.0f);
+  }
+
+  int next_int() {
+    return next() >> 32;
+  }
+
+  // Lemire's multiply-shift reduction, with rejection to stay unbiased.
+  int next_int(int max) {
+    uint64_t m = (next() >> 32) * (uint64_t)max;
+    uint32_t low = m;
+    if (low < (uint32_t)max) {
+      uint32_t threshold = -(uint32_t)max % (uint32_t)max;
+      while (low < threshold) {
+        m = (next() >> 32) * (uint64_t)max;
+        low = m;
+      }
+    }
+    return m >> 32;
+  }
+
+  private:
+  static uint64_t rotl(uint64_t x, int k) {
+    return (x << k) | (x >> (64 - k));
+  }
+
+  uint64_t next() {
+    uint64_t result = rotl(s_[1] * 5, 7) * 9;
+    uint64_t t = s_[1] << 17;
+    s_[2] ^= s_[0];
+    s_[3] ^= s_[1];
+    s_[1] ^= s_[2];
+    s_[0] ^= s_[3];
+    s_[2] ^= t;
+    s_[3] = rotl(s_[3], 45);
+    return result;
+  }
+
+  uint64_t s_[4];
+};
+
+// Derives the seed of an independent random stream from a base seed, so that
+// results depend only on the seed and the stream index and never on the order
+// in which threads happen to pick up work.
+int stream_seed(int seed, int stream) {
+  unsigned int x = seed ^ (stream * 0x9E3779B9U);
+  x ^= x >> 16;
+  x *= 0x85EBCA6BU;
+  x ^= x >> 13;
+  x *= 0xC2B2AE35U;
+  x ^= x >> 16;
+  return x;
+}
+
 
 #define FATAL { fprintf(stderr, "FATAL error in line %d\n", __LINE__); exit(1); }
 
+// Build with -DSPLENDOR_STATS to count what the annealing spends its time on
+// and to enable --trace_every. Without it the instrumentation compiles to
+// nothing.
+#ifdef SPLENDOR_STATS
+#define STAT(...) __VA_ARGS__
+#else
+#define STAT(...)
+#endif
+
 const char* color_to_string(int c) {
   if (c == 0) return "black";
   if (c == 1) return "red";
@@ -126,12 +258,75 @@ const char* color_to_string(int c) {
   FATAL;
 }
 
+// Output buffer that is written to its FILE in one go when flushed. The buffer
+// is reused, so formatting output does not allocate once it has grown.
+class Writer {
+  public:
+  explicit Writer(FILE *f) {
+    f_ = f;
+  }
+
+  ~Writer() {
+    flush();
+  }
+
+  void append(const char *format, ...) __attribute__((format(printf, 2, 3))) {
+    size_t old_size = buf_.size();
+    buf_.resize(old_size + 256);
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(&buf_[old_size], 256, format, args);
+    va_end(args);
+    if (n >= 256) {
+      buf_.resize(old_size + n + 1);
+      va_start(args, format);
+      vsnprintf(&buf_[old_size], n + 1, format, args);
+      va_end(args);
+    }
+    buf_.resize(old_size + n);
+  }
+
+  void flush() {
+    if (!buf_.empty()) fwrite(buf_.data(), 1, buf_.size(), f_);
+    buf_.clear();
+    fflush(f_);
+  }
+
+  private:
+  FILE *f_;
+  string buf_;
+};
+
+// Number of owned cards of each color, packed one byte per color (black in
+// the lowest byte) so that a card's cost can be computed with a few word-wide
+// operations.
+struct Bonus {
+  uint64_t bits;
+
+  Bonus() {
+    bits = 0;
+  }
+
+  int operator[](int color) const {
+    return (bits >> (8 * color)) & 0xFF;
+  }
+
+  void add(int color) {
+    bits += 1ULL << (8 * color);
+  }
+};
+
+const int full_deck_size = sizeof(full_deck) / sizeof(full_deck[0]);
+
 struct Card {
   char cost[5];
   char type;
   char value;
+  // Index in full_deck, or -1 if the card has not been matched against it.
+  // Not part of the card's identity.
+  signed char id;
 
-  Card() {type = -1;}
+  Card() {type = -1; id = -1;}
   Card(const Card &c) {
     cost[0] = c.cost[0];
     cost[1] = c.cost[1];
@@ -140,6 +335,7 @@ struct Card {
     cost[4] = c.cost[4];
     type = c.type;
     value = c.value;
+    id = c.id;
   }
   bool operator==(const Card &c) const {
     if (cost[0] != c.cost[0]) return false;
@@ -160,86 +356,216 @@ struct Card {
     return value < c.value;
   }
 
-  int color_str_to_int(const string &str) const {
-    if (str == "black") {
-      return 0;
-    } else if (str == "red") {
-      return 1;
-    } else if (str == "green") {
-      return 2;
-    } else if (str == "blue") {
-      return 3;
-    } else if (str == "white") {
-      return 4;
-    } else {
-      FATAL;
-    }
+  // The second letter and the length tell the color names apart, so only one
+  // name has to be compared. Returns -1 for an unknown name.
+  static int color_str_to_int(const char *str, int len) {
+    static const signed char by_hash[16] = {3, 0, -1, -1, -1, -1, -1, 2, 1, -1, -1, -1, -1, 4, -1, -1};
+    int c = len >= 2 ? by_hash[(str[1] + len) & 15] : -1;
+    if (c == -1 || strncmp(color_to_string(c), str, len) != 0 || color_to_string(c)[len] != '\0') return -1;
+    return c;
   }
 
-  bool read_from_string(const char *str) {
-    istringstream iss(str);
+  // Parses the card in [str, end) in the format of write_line. Fields are
+  // separated by whitespace; returns false if one is missing. An unknown
+  // color, or a cost or value out of range, gives type -1, which matches no
+  // card of full_deck. The ranges are wide enough for full_deck, whose largest
+  // cost is 8 and value 10, and keep larger numbers from wrapping around in
+  // the char fields to those of a real card.
+  bool read_from_string(const char *str, const char *end) {
+    bool in_range = true;
     for (int i = 0; i < 5; ++i) {
       int x;
-      iss >> x;
-      if (!iss) return false;
+      if (!read_int(&str, end, &x)) return false;
+      if (x < 0 || x > 9) in_range = false;
       cost[i] = x;
     }
 
-    string buff;
-    iss >> buff;
-    if (!iss) return false;
-    type = color_str_to_int(buff);
+    skip_space(&str, end);
+    const char *word = str;
+    while (str < end && !is_space(*str)) ++str;
+    if (str == word) return false;
+    type = color_str_to_int(word, str - word);
 
     int y;
-    iss >> y;
-    if (!iss) return false;
+    if (!read_int(&str, end, &y)) return false;
+    if (y < 0 || y > 10) in_range = false;
     value = y;
 
+    if (!in_range) type = -1;
     return true;
   }
 
-  bool read() {
-    char line[100];
-    if (fgets(line, sizeof(line), stdin) == NULL) return false;
-    if (read_from_string(line)) return true;
-    return read();
+  bool read_from_string(const char *str) {
+    return read_from_string(str, str + strlen(str));
   }
 
-  int get_cost(const vector<int> &bonuses) const {
-    int res = 0;
-    for (int i = 0; i < 5; ++i) {
-      if (bonuses[i] >= cost[i]) continue;
-      if (bonuses[i] + 4 < cost[i]) return -1;
-      res += cost[i] - bonuses[i];
+  // Like isspace in the C locale, without consulting the locale.
+  static bool is_space(char c) {
+    return c == ' ' || (c >= '\t' && c <= '\r');
+  }
+
+  static void skip_space(const char **str, const char *end) {
+    while (*str < end && is_space(**str)) ++*str;
+  }
+
+  // A decimal integer with an optional sign after optional whitespace. Values
+  // beyond a million are saturated, not wrapped.
+  static bool read_int(const char **str, const char *end, int *x) {
+    skip_space(str, end);
+    const char *p = *str;
+    bool negative = p < end && *p == '-';
+    if (p < end && (*p == '-' || *p == '+')) ++p;
+    if (p == end || *p < '0' || *p > '9') return false;
+    int v = 0;
+    for (; p < end && *p >= '0' && *p <= '9'; ++p) {
+      if (v <= 1000000) v = 10 * v + (*p - '0');
     }
-    if (res > 12) return -1;
-    return res;
+    *x = negative ? -v : v;
+    *str = p;
+    return true;
   }
 
-  string ToString() const {
-    ostringstream oss;
-    oss << color_to_string(type) << " (" << (int)value << ") ";
+  // Human readable description, e.g. "green (0) red 2, blue 2, ".
+  void describe(Writer *out) const {
+    out->append("%s (%d) ", color_to_string(type), value);
     for (int j = 0; j < 5; ++j) {
-      if (cost[j] > 0) oss << color_to_string(j) << " " << (int)cost[j] << ", ";
+      if (cost[j] > 0) out->append("%s %d, ", color_to_string(j), cost[j]);
+    }
+  }
+
+  // The card in the input format, e.g. "0 2 0 2 0 green 0".
+  void write_line(Writer *out) const {
+    out->append("%d %d %d %d %d %s %d", cost[0], cost[1], cost[2], cost[3], cost[4], color_to_string(type), value);
+  }
+};
+
+// Index of a card in full_deck. Decks and states refer to cards only by id;
+// everything a simulation needs to know about a card is in the tables below.
+typedef unsigned char CardId;
+
+// Structure-of-arrays view of full_deck indexed by card id, filled in by
+// parse_full_deck.
+Card card_by_id[full_deck_size];
+char card_type[full_deck_size];
+char card_value[full_deck_size];
+// Random keys whose xor over the cards bought identifies a checkpoint up to
+// tokens_cost: the cards bought determine the bonus, points and rounds, and
+// with the board also which cards are still on the table and in the queues.
+uint64_t card_zobrist[full_deck_size];
+// Cost one byte per color like in Bonus, with the top bit of each byte set so
+// that subtracting a Bonus never borrows across colors.
+uint64_t card_cost_word[full_deck_size];
+
+// Number of tokens needed to buy the card, or -1 if more than 4 of a single
+// color or 12 in total would be needed.
+int get_cost(CardId id, const Bonus &bonuses) {
+  const uint64_t high = 0x8080808080808080ULL;
+  // Per color 0x80 + cost - bonus, whose top bit tells whether the bonus
+  // falls short of the cost; the low bits are then the shortfall.
+  uint64_t diff = card_cost_word[id] - bonuses.bits;
+  uint64_t short_colors = ((diff & high) >> 7) * 0xFF;
+  uint64_t shortfall = diff & ~high & short_colors;
+  if ((shortfall + 0x7B7B7B7B7B7B7B7BULL) & high) return -1;
+  int res = (shortfall * 0x0101010101010101ULL) >> 56;
+  if (res > 12) return -1;
+  return res;
+}
+
+// Card ids to draw a deck from. Fixed-size, so that drawing from a copy
+// allocates nothing.
+struct CardPool {
+  CardId ids[full_deck_size];
+  int size;
+
+  CardPool() {
+    size = 0;
+  }
+};
+
+// Set of cards of full_deck as a bit mask over card ids.
+struct CardSet {
+  uint64_t bits[2];
+
+  CardSet() {
+    bits[0] = bits[1] = 0;
+  }
+
+  void insert(CardId id) {
+    bits[id >> 6] |= 1ULL << (id & 63);
+  }
+
+  bool contains(CardId id) const {
+    return (bits[id >> 6] >> (id & 63)) & 1;
+  }
+
+  CardSet operator-(const CardSet &other) const {
+    CardSet result;
+    result.bits[0] = bits[0] & ~other.bits[0];
+    result.bits[1] = bits[1] & ~other.bits[1];
+    return result;
+  }
+
+  int size() const {
+    return __builtin_popcountll(bits[0]) + __builtin_popcountll(bits[1]);
+  }
+
+  // Appends the ids in increasing order.
+  void append_to(CardPool *pool) const {
+    for (int i = 0; i < 2; ++i) {
+      for (uint64_t b = bits[i]; b != 0; b &= b - 1) pool->ids[pool->size++] = 64 * i + __builtin_ctzll(b);
     }
-    return oss.str();
   }
 };
 
-set<Card> full_deck_set;
+static_assert(full_deck_size <= 128, "CardSet is too small for full_deck");
+
+// Cards of full_deck by the deck they belong to: cards worth 0 points, worth
+// 10 points and all the others.
+CardSet full_deck_level[3];
+
+int card_level(const Card &c) {
+  if (c.value == 0) return 0;
+  if (c.value == 10) return 2;
+  return 1;
+}
+
+// Id of the full_deck card equal to c, or -1 if there is none.
+int find_card_id(const Card &c) {
+  for (int i = 0; i < full_deck_size; ++i) {
+    if (card_by_id[i] == c) return i;
+  }
+  return -1;
+}
+
 void parse_full_deck() {
-  int sz = sizeof(full_deck) / sizeof(full_deck[0]);
-  for (int i = 0; i < sz; ++i) {
+  for (int i = 0; i < full_deck_size; ++i) {
     Card c;
     c.read_from_string(full_deck[i]);
-    full_deck_set.insert(c);
+    c.id = i;
+    full_deck_level[card_level(c)].insert(i);
+
+    card_by_id[i] = c;
+    card_type[i] = c.type;
+    card_value[i] = c.value;
+    card_cost_word[i] = 0x8080808080808080ULL;
+    for (int j = 0; j < 5; ++j) card_cost_word[i] += (uint64_t)c.cost[j] << (8 * j);
+    card_zobrist[i] = mix64((i + 1) * 0x9E3779B97F4A7C15ULL);
   }
 }
 
+// Mutable part of a Deck during a simulation: which card lies in each table
+// slot and how much of the queue is left. The Deck itself is never modified, so
+// starting a new simulation costs a copy of a few bytes instead of the cards.
+struct DeckState {
+  // Card index as understood by Deck::card(), or -1 for an empty slot.
+  signed char slot[4];
+  signed char q_sz;
+};
+
 struct Deck {
-  Card table[4];
+  CardId table[4];
   int table_sz;
-  Card q[30];
+  CardId q[30];
   int q_sz;
 
   Deck() {
@@ -247,71 +573,173 @@ struct Deck {
     q_sz = 0;
   }
 
-  void add_card(const Card &c) {
+  // Returns false if the deck is full.
+  bool add_card(CardId c) {
     if (table_sz < 4) table[table_sz++] = c;
-    else q[q_sz++] = c;
+    else if (q_sz < (int)(sizeof(q) / sizeof(q[0]))) q[q_sz++] = c;
+    else return false;
+    return true;
   }
 
-  bool can_peak_card(int idx) const {
-    if (table_sz < idx) return false;
-    if (table[idx].type == -1) return false;
-    return true;
+  bool contains(CardId c) const {
+    for (int i = 0; i < table_sz; ++i) {
+      if (table[i] == c) return true;
+    }
+    for (int i = 0; i < q_sz; ++i) {
+      if (q[i] == c) return true;
+    }
+    return false;
+  }
+
+  // Indices 0-3 refer to the initial table, the following ones to the queue.
+  CardId card(int idx) const {
+    return idx < 4 ? table[idx] : q[idx - 4];
   }
 
-  void pop_card(int idx) {
-    table[idx].type = -1;
-    if (q_sz > 0) {
-      table[idx] = q[--q_sz];
+  DeckState initial_state() const {
+    DeckState st;
+    for (int i = 0; i < 4; ++i) {
+      st.slot[i] = i < table_sz ? i : -1;
     }
+    st.q_sz = q_sz;
+    return st;
+  }
+
+  bool can_peak_card(const DeckState &st, int idx) const {
+    return st.slot[idx] != -1;
+  }
+
+  void pop_card(DeckState *st, int idx) const {
+    st->slot[idx] = st->q_sz > 0 ? 4 + --st->q_sz : -1;
   }
 
-  set<Card> to_set() const {
-    set<Card> result;
+  CardSet cards() const {
+    CardSet result;
     for (int i = 0; i < table_sz; ++i) result.insert(table[i]);
     for (int i = 0; i < q_sz; ++i) result.insert(q[i]);
     return result;
   }
 
-  bool process_move(int x, int *points, int *tokens_cost, int *rounds, vector<int> *bonus, Card *card_sequence) {
-    if (!can_peak_card(x)) return false;
+  bool process_move(DeckState *st, int x, int *points, int *tokens_cost, int *rounds, Bonus *bonus, CardId *card_sequence) const {
+    if (!can_peak_card(*st, x)) return false;
 
-    int cost = table[x].get_cost(*bonus);
+    CardId c = card(st->slot[x]);
+    int cost = get_cost(c, *bonus);
     if (cost == -1) return false;
     if (*rounds + 1 + (*tokens_cost + 3 + cost) / 4 > 28) return false;
 
     *tokens_cost += cost;
     *rounds += 1;
-    *points += table[x].value;
-    (*bonus)[table[x].type] += 1;
-    *card_sequence = table[x];
-    pop_card(x);
+    *points += card_value[c];
+    bonus->add(card_type[c]);
+    if (card_sequence != NULL) *card_sequence = c;
+    pop_card(st, x);
     return true;
   }
 
-  void fill_up_randomly(int desired_size, vector<Card> v, Twister *setup_twister) {
-    while (table_sz < 4 && !v.empty()) {
-      int x = setup_twister->next_int(v.size());
-      table[table_sz++] = v[x];
-      swap(v[x], v.back());
-      v.pop_back();
+  // Cards fill_up(desired_size, ...) adds if enough of them are given.
+  int missing(int desired_size) const {
+    return max(0, 4 - table_sz) + max(0, desired_size - q_sz);
+  }
+
+  // Draws from a copy of v, so that every call with the same pool and
+  // generator state draws the same cards.
+  // Rng is Twister or CompletionIndex.
+  template <class Rng>
+  void fill_up_randomly(int desired_size, CardPool v, Rng *setup_twister) {
+    while (table_sz < 4 && v.size > 0) {
+      int x = setup_twister->next_int(v.size);
+      table[table_sz++] = v.ids[x];
+      v.ids[x] = v.ids[--v.size];
+    }
+
+    while (q_sz < desired_size && v.size > 0) {
+      int x = setup_twister->next_int(v.size);
+      q[q_sz++] = v.ids[x];
+      v.ids[x] = v.ids[--v.size];
     }
+  }
 
-    while (q_sz < desired_size && !v.empty()) {
-      int x = setup_twister->next_int(v.size());
-      q[q_sz++] = v[x];
-      swap(v[x], v.back());
-      v.pop_back();
+  // Fills the table and then the queue up to desired_size with the cards of
+  // order that are not in the deck yet, in that order.
+  void fill_up(int desired_size, const CardPool &order) {
+    CardSet known = cards();
+    for (int i = 0; i < order.size && (table_sz < 4 || q_sz < desired_size); ++i) {
+      if (known.contains(order.ids[i])) continue;
+      if (table_sz < 4) table[table_sz++] = order.ids[i];
+      else q[q_sz++] = order.ids[i];
     }
   }
 };
 
+// Simulation state reached after playing a prefix of a move sequence.
+struct Checkpoint {
+  DeckState decks[3];
+  Bonus bonus;
+  int points;
+  int tokens_cost;
+  int rounds;
+};
+
+Checkpoint initial_checkpoint(const Deck &d1, const Deck &d2, const Deck &d3) {
+  Checkpoint cp;
+  cp.decks[0] = d1.initial_state();
+  cp.decks[1] = d2.initial_state();
+  cp.decks[2] = d3.initial_state();
+  cp.points = 0;
+  cp.tokens_cost = 0;
+  cp.rounds = 0;
+  return cp;
+}
+
+// Upper bound on the points of any play continuing from cp.
+//
+// Buying a card costs a round plus a quarter round per token, and the 28
+// rounds bound the total, so in quarter rounds a card weighs 4 + its cost and
+// the budget is 4 * (28 - rounds) - tokens_cost. Only the cards not bought
+// yet can be bought, each for at least its cost given the most bonus it could
+// have by then: the current bonus plus one per card still affordable in
+// rounds. That is a knapsack, and for any price lambda per quarter round its
+// LP dual lambda * budget + sum of max(0, value - lambda * weight) is a bound.
+// A few prices are tried instead of sorting the cards by value per weight.
+// Cards of the first level are worth 0 points and add nothing, so its deck is
+// not needed.
+int points_bound(const Deck &d2, const Deck &d3, const Checkpoint &cp) {
+  int more_cards = 28 - cp.rounds - (cp.tokens_cost + 3) / 4;
+  if (more_cards <= 0) return cp.points;
+  Bonus most;
+  most.bits = cp.bonus.bits + 0x0101010101ULL * more_cards;
+  int budget = 4 * (28 - cp.rounds) - cp.tokens_cost;
+
+  // Prices in 1/16 point per quarter round, and 16 times their bound.
+  const int prices = 10;
+  static const int price[prices] = {0, 1, 2, 3, 4, 5, 6, 8, 10, 12};
+  int dual[prices];
+  for (int k = 0; k < prices; ++k) dual[k] = price[k] * budget;
+  const Deck *decks[2] = {&d2, &d3};
+  for (int d = 0; d < 2; ++d) {
+    const DeckState &st = cp.decks[d + 1];
+    for (int i = -4; i < st.q_sz; ++i) {
+      if (i < 0 && st.slot[i + 4] == -1) continue;
+      CardId c = i < 0 ? decks[d]->card(st.slot[i + 4]) : decks[d]->q[i];
+      int cost = get_cost(c, most);
+      if (cost == -1) continue;
+      int value = 16 * card_value[c];
+      for (int k = 0; k < prices; ++k) dual[k] += max(0, value - price[k] * (4 + cost));
+    }
+  }
+  int best = dual[0];
+  for (int k = 1; k < prices; ++k) best = min(best, dual[k]);
+  return cp.points + best / 16;
+}
+
 struct State {
   char move_sequence[40];
   int move_sequence_sz;
   int points;
   int tokens_cost;
   int rounds;
-  Card card_sequence[40];
+  CardId card_sequence[40];
   int card_sequence_sz;
 
   State() {
@@ -340,24 +768,67 @@ struct State {
     card_sequence_sz = st.card_sequence_sz;
   }
 
-  void play_out(Deck d1, Deck d2, Deck d3, const State &cand) {
-    vector<int> bonus(5, 0);
+  // Plays the moves of cand from position `from` on. The first `from` moves of
+  // cand must be playable and lead to checkpoints[from]; they are taken over
+  // without being simulated again. Moves that cannot be played are dropped and
+  // the state after the k-th kept move is stored in checkpoints[k].
+  void play_out(const Deck &d1, const Deck &d2, const Deck &d3, const State &cand, int from, Checkpoint *checkpoints) {
+    memcpy(move_sequence, cand.move_sequence, from);
+    move_sequence_sz = from;
+    card_sequence_sz = 0;
 
-    int ptr = 0;
+    Checkpoint cp = checkpoints[from];
+    int ptr = from;
     while (ptr < cand.move_sequence_sz) {
       int move = cand.move_sequence[ptr++];
       int x = move % 16;
 
-      if ((x < 4 && d1.process_move(x, &points, &tokens_cost, &rounds, &bonus, card_sequence + card_sequence_sz)) ||
-          (x >= 4 && x < 8 && d2.process_move(x - 4, &points, &tokens_cost, &rounds, &bonus, card_sequence + card_sequence_sz)) ||
-          (x >= 8 && d3.process_move(x - 8, &points, &tokens_cost, &rounds, &bonus, card_sequence + card_sequence_sz))) {
+      if ((x < 4 && d1.process_move(&cp.decks[0], x, &cp.points, &cp.tokens_cost, &cp.rounds, &cp.bonus, NULL)) ||
+          (x >= 4 && x < 8 && d2.process_move(&cp.decks[1], x - 4, &cp.points, &cp.tokens_cost, &cp.rounds, &cp.bonus, NULL)) ||
+          (x >= 8 && d3.process_move(&cp.decks[2], x - 8, &cp.points, &cp.tokens_cost, &cp.rounds, &cp.bonus, NULL))) {
         move_sequence[move_sequence_sz++] = x;
-        ++card_sequence_sz;
+        checkpoints[move_sequence_sz] = cp;
       }
     }
+    points = cp.points;
+    tokens_cost = cp.tokens_cost;
+    rounds = cp.rounds;
+  }
+
+  // Replays the (fully playable) move sequence to fill in card_sequence, which
+  // play_out does not maintain.
+  void record_cards(const Deck &d1, const Deck &d2, const Deck &d3) {
+    Checkpoint cp = initial_checkpoint(d1, d2, d3);
+    for (card_sequence_sz = 0; card_sequence_sz < move_sequence_sz; ++card_sequence_sz) {
+      int x = move_sequence[card_sequence_sz];
+      CardId *c = card_sequence + card_sequence_sz;
+      if (x < 4) d1.process_move(&cp.decks[0], x, &cp.points, &cp.tokens_cost, &cp.rounds, &cp.bonus, c);
+      else if (x < 8) d2.process_move(&cp.decks[1], x - 4, &cp.points, &cp.tokens_cost, &cp.rounds, &cp.bonus, c);
+      else d3.process_move(&cp.decks[2], x - 8, &cp.points, &cp.tokens_cost, &cp.rounds, &cp.bonus, c);
+    }
+  }
+
+  // Whether the candidate is this (fully playable) sequence with one move
+  // inserted at pos that cannot be played there. play_out would drop that move
+  // and reproduce this sequence exactly; checkpoints[pos] is the state before
+  // it.
+  bool is_noop_insert(const Deck &d1, const Deck &d2, const Deck &d3, const State &cand, int pos, const Checkpoint *checkpoints) const {
+    if (cand.move_sequence_sz != move_sequence_sz + 1) return false;
+    Checkpoint cp = checkpoints[pos];
+    int x = cand.move_sequence[pos];
+    if (x < 4) return !d1.process_move(&cp.decks[0], x, &cp.points, &cp.tokens_cost, &cp.rounds, &cp.bonus, NULL);
+    if (x < 8) return !d2.process_move(&cp.decks[1], x - 4, &cp.points, &cp.tokens_cost, &cp.rounds, &cp.bonus, NULL);
+    return !d3.process_move(&cp.decks[2], x - 8, &cp.points, &cp.tokens_cost, &cp.rounds, &cp.bonus, NULL);
+  }
+
+  bool same_moves(const State &st) const {
+    return move_sequence_sz == st.move_sequence_sz && memcmp(move_sequence, st.move_sequence, move_sequence_sz) == 0;
   }
 
-  bool mutate(Twister *twister) {
+  // On success stores the first position at which the sequence changed.
+  // Rng is Twister or Xoshiro.
+  template <class Rng>
+  bool mutate(Rng *twister, int *first_changed) {
     int mod = twister->next_int(3);
     if (mod == 0) {
       // CHANGE
@@ -371,6 +842,7 @@ struct State {
         move_sequence[pos] = next;
         break;
       }
+      *first_changed = pos;
     } else if (mod == 1) {
       // INSERT
       if (move_sequence_sz > 30) return false;
@@ -378,6 +850,7 @@ struct State {
       for (int i = move_sequence_sz; i > pos; --i) move_sequence[i] = move_sequence[i - 1];
       move_sequence[pos] = twister->next_int(10);
       ++move_sequence_sz;
+      *first_changed = pos;
     } else if (mod == 2) {
       // SWAP
       if (move_sequence_sz < 3) return false;
@@ -386,121 +859,2177 @@ struct State {
       if (px == py) return false;
       if (move_sequence[px] == move_sequence[py]) return false;
       swap(move_sequence[px], move_sequence[py]);
+      *first_changed = min(px, py);
     }
     return true;
   }
 
-  void print() {
+  void print(Writer *out) const {
+    if (card_sequence_sz != move_sequence_sz) FATAL;
+    out->append("\npoints: %d, rounds: %d, tokens_cost: %d, cc %d\n", points, rounds, tokens_cost, rounds + (tokens_cost + 3) / 4);
+    for (int i = 0; i < move_sequence_sz; ++i) {
+      out->append("%d: ", move_sequence[i]);
+      card_by_id[card_sequence[i]].describe(out);
+      out->append("\n");
+    }
+    out->append("\n\n");
+  }
+
+  // Fields of a JSON object describing the play, without the braces.
+  void print_json_fields(Writer *out) const {
     if (card_sequence_sz != move_sequence_sz) FATAL;
-    printf("\npoints: %d, rounds: %d, tokens_cost: %d, cc %d\n", points, rounds, tokens_cost, rounds + (tokens_cost + 3) / 4);
+    out->append("\"points\":%d,\"rounds\":%d,\"tokens_cost\":%d,\"moves\":[", points, rounds, tokens_cost);
+    for (int i = 0; i < move_sequence_sz; ++i) out->append(i > 0 ? ",%d" : "%d", move_sequence[i]);
+    out->append("],\"cards\":[");
     for (int i = 0; i < move_sequence_sz; ++i) {
-      printf("%d: %s\n", move_sequence[i], card_sequence[i].ToString().c_str());
+      out->append(i > 0 ? ",\"" : "\"");
+      card_by_id[card_sequence[i]].write_line(out);
+      out->append("\"");
+    }
+    out->append("]");
+  }
+};
+
+
+// Hash index from the keys of the beam search nodes of a layer to their
+// positions, used by one worker at a time. A store simply replaces the entry
+// in its slot, so the index may forget a node but never grows or allocates
+// after reset; the beam search checks every hit against the node itself.
+class BeamIndex {
+  public:
+  BeamIndex() {
+    bits_ = 0;
+  }
+
+  int bits() const {
+    return bits_;
+  }
+
+  // Drops all entries and makes room for 2^bits of them.
+  void reset(int bits) {
+    bits_ = bits;
+    entries_.assign(1 << bits, Entry());
+  }
+
+  bool find(uint64_t key, uint64_t *value) const {
+    const Entry &e = entries_[key >> (64 - bits_)];
+    if (e.key != key) return false;
+    *value = e.value;
+    return true;
+  }
+
+  void store(uint64_t key, uint64_t value) {
+    Entry &e = entries_[key >> (64 - bits_)];
+    e.key = key;
+    e.value = value;
+  }
+
+  private:
+  struct Entry {
+    uint64_t key = 0;
+    uint64_t value = 0;
+  };
+
+  int bits_;
+  vector<Entry> entries_;
+};
+
+// Checkpoint reached by the beam search and the move that led to it from
+// node `parent` of the previous layer.
+struct BeamNode {
+  Checkpoint cp;
+  // Xor of card_zobrist over the cards bought.
+  uint64_t key;
+  int parent;
+  int move;
+};
+
+// Most chains of the parallel tempering engine.
+const int max_replicas = 64;
+
+enum Engine {
+  ENGINE_ANNEAL,
+  ENGINE_BEAM,
+  ENGINE_TEMPERING,
+};
+
+// Simulation budget and seeds, settable from the command line.
+struct Options {
+  int boards;
+  int restarts;
+  int steps;
+  double start_temp;
+  double final_temp;
+  int setup_seed;
+  int annealing_seed;
+  // 0 means one thread per core.
+  int threads;
+  // Points needed to win.
+  int target;
+  // Stop annealing a board as soon as one of its restarts reaches the target.
+  bool decision;
+  // Solvability likelihood of a random board, in percent.
+  double baseline;
+  // If positive, boards becomes an upper limit: sampling stops once the 95%
+  // confidence interval of the likelihood is narrower than this many percent,
+  // or once it lies entirely on one side of the baseline.
+  double ci_width;
+  // Boards evaluated before the stopping rule is applied.
+  int min_boards;
+  // Evaluate every completion of the hidden cards once instead of sampling
+  // boards when there are at most `boards` of them.
+  bool enumerate;
+  // Read several scenarios separated by "---" lines and report one line each.
+  bool batch;
+  // Print JSON lines instead of text.
+  bool json;
+  // Print every play that improves a board's best to at least the target.
+  bool print_solutions;
+  // Minimum time between two progress updates.
+  int progress_ms;
+  // Candidates played out per annealing step; the best one is then subject to
+  // the usual acceptance test.
+  int neighbors;
+  // Anneal with Xoshiro instead of Twister. Boards are always drawn with a
+  // Twister, so they stay the same either way.
+  bool xoshiro;
+  Engine engine;
+  // Nodes kept per layer by the beam search, 0 for an exact search.
+  int beam_width;
+  // Chains of the parallel tempering engine.
+  int replicas;
+  // Report how many annealing candidates were wasted on no-op mutations.
+  bool step_stats;
+  // Time the simulation hot paths instead of estimating anything.
+  bool bench;
+  // Reheat or end annealing runs that stopped improving, see Stagnation.
+  bool adaptive;
+  // With SPLENDOR_STATS, print the state of every restart to stderr every
+  // this many steps.
+  int trace_every;
+  // File remembering the results of boards across runs, or NULL.
+  const char *cache;
+  // Unix socket to serve scenarios on, "-" for stdin, or NULL.
+  const char *serve;
+
+  Options() {
+    boards = 50;
+    restarts = 10;
+    steps = 200000;
+    start_temp = 2;
+    final_temp = 0.1;
+    setup_seed = 23590421;
+    annealing_seed = 549120939;
+    threads = 0;
+    target = 31;
+    decision = false;
+    baseline = 3.7;
+    ci_width = 0;
+    min_boards = 10;
+    batch = false;
+    json = false;
+    print_solutions = true;
+    enumerate = true;
+    progress_ms = 100;
+    xoshiro = false;
+    neighbors = 1;
+    engine = ENGINE_ANNEAL;
+    beam_width = 5000;
+    replicas = 8;
+    step_stats = false;
+    bench = false;
+    adaptive = false;
+    trace_every = 0;
+    cache = NULL;
+    serve = NULL;
+  }
+};
+
+void usage() {
+  Options d;
+  fprintf(stderr,
+      "Usage: splendor [flags] < scenario\n"
+      "  --boards=N          randomized boards to evaluate (%d)\n"
+      "  --restarts=N        annealing restarts per board (%d)\n"
+      "  --steps=N           annealing steps per restart (%d)\n"
+      "  --start_temp=X      initial annealing temperature (%g)\n"
+      "  --final_temp=X      final annealing temperature (%g)\n"
+      "  --setup_seed=N      seed of the board randomization (%d)\n"
+      "  --annealing_seed=N  seed of the annealing (%d)\n"
+      "  --threads=N         worker threads, 0 for one per core (%d)\n"
+      "  --target=N          points needed to win (%d)\n"
+      "  --decision          stop working on a board once it reaches the target;\n"
+      "                      the reported maximum is then only a lower bound;\n"
+      "                      only --engine=beam --beam_width=0 proves that a\n"
+      "                      board cannot reach it\n"
+      "  --baseline=X        likelihood of a random board, in percent (%g)\n"
+      "  --ci_width=X        stop sampling boards once the 95%% confidence interval\n"
+      "                      is narrower than X percent or excludes the baseline;\n"
+      "                      --boards is then the upper limit (off)\n"
+      "  --min_boards=N      boards sampled before stopping early (%d)\n"
+      "  --enumerate=B       if the hidden cards can be dealt in at most --boards\n"
+      "                      ways, evaluate each once instead of sampling, 0 or 1;\n"
+      "                      on by default, so a fully revealed scenario is one\n"
+      "                      board; the share of solvable boards is exact only\n"
+      "                      with --engine=beam --beam_width=0 (%d)\n"
+      "  --batch             read scenarios separated by lines starting with ---\n"
+      "                      and print one result line per scenario\n"
+      "  --format=F          text or json; json prints one object per line with a\n"
+      "                      type of progress, solution or result (text)\n"
+      "  --print_solutions=B print winning plays, 0 or 1 (%d)\n"
+      "  --progress_ms=N     minimum time between progress updates (%d)\n"
+      "  --rng=R             annealing generator, mt (Mersenne Twister, as in\n"
+      "                      earlier versions) or xoshiro (mt)\n"
+      "  --neighbors=K       play out K mutations per annealing step and submit\n"
+      "                      the best to the acceptance test (%d)\n"
+      "  --engine=E          anneal (simulated annealing), beam (beam search over\n"
+      "                      the cards bought) or tempering (replica exchange\n"
+      "                      between chains at fixed temperatures from\n"
+      "                      --final_temp to --start_temp, sharing the budget of\n"
+      "                      --restarts x --steps); beam does one run per board\n"
+      "                      and tempering runs its chains on up to --replicas\n"
+      "                      threads (anneal)\n"
+      "  --beam_width=N      states kept per beam search layer, 0 for an exact\n"
+      "                      search, which is fastest with --decision (%d)\n"
+      "  --replicas=K        tempering chains, 2 to %d (%d)\n"
+      "  --step_stats        report the annealing candidates whose mutation was a\n"
+      "                      no-op, skipped or played out\n"
+      "  --bench             time the simulation hot paths on the first board of\n"
+      "                      the scenario and exit; the annealing pass uses\n"
+      "                      --restarts, --steps, --neighbors and --rng\n"
+      "  --cache=FILE        remember the result of every board in FILE and reuse\n"
+      "                      it for boards of later runs with the same cards and\n"
+      "                      budget; boards are then dealt so that they survive\n"
+      "                      more revealed cards, unlike the boards of runs\n"
+      "                      without a cache; fails while another run has FILE\n"
+      "                      open\n"
+      "  --serve=PATH        evaluate scenarios sent over the Unix socket PATH, or\n"
+      "                      stdin with -, until killed; a scenario is cancelled\n"
+      "                      once the next one or the end of the input arrives;\n"
+      "                      implies --batch and --format=json\n"
+      "  --schedule=S        geometric (cool from --start_temp to --final_temp in\n"
+      "                      --steps) or adaptive (the same, but reheat or end\n"
+      "                      restarts that froze without improving) (geometric)\n"
+#ifdef SPLENDOR_STATS
+      "  --trace_every=N     print \"trace seed step temp points best\" for every\n"
+      "                      annealing restart to stderr every N steps (off)\n"
+#endif
+      ,
+      d.boards, d.restarts, d.steps, d.start_temp, d.final_temp, d.setup_seed, d.annealing_seed, d.threads, d.target,
+      d.baseline, d.min_boards, d.enumerate, d.print_solutions, d.progress_ms, d.neighbors,
+      d.beam_width, max_replicas, d.replicas);
+  exit(1);
+}
+
+// If arg is --name=value, points *value at the value.
+bool match_flag(const char *arg, const char *name, const char **value) {
+  int len = strlen(name);
+  if (strncmp(arg, "--", 2) != 0 || strncmp(arg + 2, name, len) != 0 || arg[2 + len] != '=') return false;
+  *value = arg + 3 + len;
+  return true;
+}
+
+int parse_int_flag(const char *value, int min) {
+  char *end;
+  long x = strtol(value, &end, 10);
+  if (*value == '\0' || *end != '\0' || x < min || x > 0x7FFFFFFF) usage();
+  return x;
+}
+
+double parse_double_flag(const char *value) {
+  char *end;
+  double x = strtod(value, &end);
+  if (*value == '\0' || *end != '\0' || !(x > 0)) usage();
+  return x;
+}
+
+void parse_flags(int argc, char **argv, Options *options) {
+  for (int i = 1; i < argc; ++i) {
+    const char *value;
+    if (match_flag(argv[i], "boards", &value)) {
+      options->boards = parse_int_flag(value, 1);
+    } else if (match_flag(argv[i], "restarts", &value)) {
+      options->restarts = parse_int_flag(value, 1);
+    } else if (match_flag(argv[i], "steps", &value)) {
+      options->steps = parse_int_flag(value, 1);
+    } else if (match_flag(argv[i], "start_temp", &value)) {
+      options->start_temp = parse_double_flag(value);
+    } else if (match_flag(argv[i], "final_temp", &value)) {
+      options->final_temp = parse_double_flag(value);
+    } else if (match_flag(argv[i], "setup_seed", &value)) {
+      options->setup_seed = parse_int_flag(value, 0);
+    } else if (match_flag(argv[i], "annealing_seed", &value)) {
+      options->annealing_seed = parse_int_flag(value, 0);
+    } else if (match_flag(argv[i], "threads", &value)) {
+      options->threads = parse_int_flag(value, 0);
+    } else if (match_flag(argv[i], "target", &value)) {
+      options->target = parse_int_flag(value, 1);
+    } else if (strcmp(argv[i], "--decision") == 0) {
+      options->decision = true;
+    } else if (match_flag(argv[i], "baseline", &value)) {
+      options->baseline = parse_double_flag(value);
+    } else if (match_flag(argv[i], "ci_width", &value)) {
+      options->ci_width = parse_double_flag(value);
+    } else if (match_flag(argv[i], "min_boards", &value)) {
+      options->min_boards = parse_int_flag(value, 1);
+    } else if (strcmp(argv[i], "--batch") == 0) {
+      options->batch = true;
+    } else if (match_flag(argv[i], "format", &value)) {
+      if (strcmp(value, "text") == 0) options->json = false;
+      else if (strcmp(value, "json") == 0) options->json = true;
+      else usage();
+    } else if (match_flag(argv[i], "enumerate", &value)) {
+      options->enumerate = parse_int_flag(value, 0) != 0;
+    } else if (match_flag(argv[i], "print_solutions", &value)) {
+      options->print_solutions = parse_int_flag(value, 0) != 0;
+    } else if (match_flag(argv[i], "progress_ms", &value)) {
+      options->progress_ms = parse_int_flag(value, 0);
+    } else if (match_flag(argv[i], "neighbors", &value)) {
+      options->neighbors = parse_int_flag(value, 1);
+    } else if (match_flag(argv[i], "engine", &value)) {
+      if (strcmp(value, "anneal") == 0) options->engine = ENGINE_ANNEAL;
+      else if (strcmp(value, "beam") == 0) options->engine = ENGINE_BEAM;
+      else if (strcmp(value, "tempering") == 0) options->engine = ENGINE_TEMPERING;
+      else usage();
+    } else if (match_flag(argv[i], "beam_width", &value)) {
+      options->beam_width = parse_int_flag(value, 0);
+    } else if (match_flag(argv[i], "replicas", &value)) {
+      options->replicas = parse_int_flag(value, 2);
+      if (options->replicas > max_replicas) usage();
+#ifdef SPLENDOR_STATS
+    } else if (match_flag(argv[i], "trace_every", &value)) {
+      options->trace_every = parse_int_flag(value, 0);
+#endif
+    } else if (match_flag(argv[i], "cache", &value)) {
+      if (*value == '\0') usage();
+      options->cache = value;
+    } else if (match_flag(argv[i], "serve", &value)) {
+      if (*value == '\0') usage();
+      options->serve = value;
+      options->batch = true;
+      options->json = true;
+    } else if (match_flag(argv[i], "schedule", &value)) {
+      if (strcmp(value, "geometric") == 0) options->adaptive = false;
+      else if (strcmp(value, "adaptive") == 0) options->adaptive = true;
+      else usage();
+    } else if (strcmp(argv[i], "--bench") == 0) {
+      options->bench = true;
+    } else if (strcmp(argv[i], "--step_stats") == 0) {
+      options->step_stats = true;
+    } else if (match_flag(argv[i], "rng", &value)) {
+      if (strcmp(value, "mt") == 0) options->xoshiro = false;
+      else if (strcmp(value, "xoshiro") == 0) options->xoshiro = true;
+      else usage();
+    } else {
+      usage();
+    }
+  }
+  if (options->final_temp >= options->start_temp) usage();
+}
+
+// Annealing counters of one thread, see STAT. Schedule-dependent ones are
+// kept per tenth of the steps.
+struct Stats {
+  static const int tenths = 10;
+  long long candidates;
+  long long mutate_failures;
+  long long moves_played_out;
+  long long moves_dropped;
+  long long worse[tenths];
+  long long worse_accepted[tenths];
+  long long restarts;
+  long long best_found[tenths];
+
+  Stats() {
+    memset(this, 0, sizeof(*this));
+  }
+
+  static int tenth(int step, int steps) {
+    return min(tenths - 1, (int)((long long)step * tenths / steps));
+  }
+
+  void add(const Stats &other) {
+    candidates += other.candidates;
+    mutate_failures += other.mutate_failures;
+    moves_played_out += other.moves_played_out;
+    moves_dropped += other.moves_dropped;
+    restarts += other.restarts;
+    for (int i = 0; i < tenths; ++i) {
+      worse[i] += other.worse[i];
+      worse_accepted[i] += other.worse_accepted[i];
+      best_found[i] += other.best_found[i];
+    }
+  }
+
+  void print(FILE *f, const Options &options) const {
+    fprintf(f, "candidates: %lld, failed mutations retried: %lld (%.2f per candidate)\n",
+            candidates, mutate_failures, mutate_failures / max(1.0, (double)candidates));
+    fprintf(f, "moves played out: %lld, dropped by process_move: %lld (%.2f %%)\n",
+            moves_played_out, moves_dropped, 100.0 * moves_dropped / max(1.0, (double)moves_played_out));
+    fprintf(f, "tenth  temperature  worse candidates  accepted  restarts with final best\n");
+    for (int i = 0; i < tenths; ++i) {
+      double temp = options.start_temp * pow(options.final_temp / options.start_temp, (i + 0.5) / tenths);
+      fprintf(f, "%5d  %11.3f  %16lld  %7.2f%%  %lld\n", i + 1, temp, worse[i],
+              100.0 * worse_accepted[i] / max(1.0, (double)worse[i]), best_found[i]);
+    }
+  }
+};
+
+// Per-thread context handed to every task executed by a WorkerPool.
+struct Worker {
+  int id;
+  // Only the generator selected by --rng is used.
+  Twister annealing_twister;
+  Xoshiro annealing_xoshiro;
+  // Simulation states after each move of the current annealing solution and
+  // of the candidate being evaluated.
+  Checkpoint checkpoints[41];
+  Checkpoint candidate_checkpoints[41];
+  // Those of the runner-up candidate with --neighbors.
+  Checkpoint neighbor_checkpoints[41];
+  // Only maintained with SPLENDOR_STATS.
+  Stats stats;
+  // Seed of the restart being annealed, to tell traces apart.
+  int restart_seed;
+  // Beam search layers, kept to reuse their memory, and the index of each
+  // key in the layer being built.
+  vector<vector<BeamNode> > beam_layers;
+  BeamIndex beam_index;
+};
+
+// Fixed set of threads executing queued tasks in FIFO order.
+class WorkerPool {
+  public:
+  explicit WorkerPool(int threads) {
+    stop_ = false;
+    workers_.resize(threads);
+    for (int i = 0; i < threads; ++i) {
+      workers_[i].id = i;
+      threads_.push_back(thread(&WorkerPool::run, this, &workers_[i]));
+    }
+  }
+
+  ~WorkerPool() {
+    {
+      lock_guard<mutex> lock(mu_);
+      stop_ = true;
+    }
+    cv_.notify_all();
+    for (size_t i = 0; i < threads_.size(); ++i) threads_[i].join();
+  }
+
+  void submit(const function<void(Worker*)> &task) {
+    {
+      lock_guard<mutex> lock(mu_);
+      tasks_.push_back(task);
+    }
+    cv_.notify_one();
+  }
+
+  int size() const {
+    return threads_.size();
+  }
+
+  // Only to be used while no tasks are running.
+  const Worker &worker(int i) const {
+    return workers_[i];
+  }
+
+  static int default_size() {
+    int n = thread::hardware_concurrency();
+    return n > 0 ? n : 1;
+  }
+
+  private:
+  void run(Worker *worker) {
+    while (true) {
+      function<void(Worker*)> task;
+      {
+        unique_lock<mutex> lock(mu_);
+        while (!stop_ && tasks_.empty()) cv_.wait(lock);
+        if (tasks_.empty()) return;
+        task = tasks_.front();
+        tasks_.pop_front();
+      }
+      task(worker);
     }
-    printf("\n\n");
-    fflush(stdout);
   }
+
+  mutex mu_;
+  condition_variable cv_;
+  deque<function<void(Worker*)> > tasks_;
+  bool stop_;
+  vector<Worker> workers_;
+  vector<thread> threads_;
 };
 
+// How the annealing candidates of one or more runs were spent.
+struct StepCounts {
+  long long candidates;
+  // Inserts of a move that cannot be played, recognized without playing out.
+  long long skipped;
+  // Candidates played out only to reproduce the current sequence.
+  long long repeats;
+
+  StepCounts() {
+    candidates = skipped = repeats = 0;
+  }
 
-State best_state;
+  void add(const StepCounts &other) {
+    candidates += other.candidates;
+    skipped += other.skipped;
+    repeats += other.repeats;
+  }
+};
+
+// Best play found by one or more annealing runs.
+struct SearchResult {
+  State best;
+  // Every improvement to at least the target, in the order it was found.
+  deque<State> solutions;
+  StepCounts counts;
+
+  // Folds in a run that conceptually happened after this one, keeping only
+  // the solutions that would have been improvements at the time.
+  void merge(const SearchResult &later) {
+    for (size_t i = 0; i < later.solutions.size(); ++i) {
+      if (later.solutions[i].points <= best.points) continue;
+      solutions.push_back(State());
+      solutions.back().DeepCopy(later.solutions[i]);
+      best.DeepCopy(later.solutions[i]);
+    }
+    if (later.best.points > best.points) best.DeepCopy(later.best);
+    counts.add(later.counts);
+  }
+};
+
+// A randomized completion of the scenario together with the best play found.
+struct Board {
+  Deck d1, d2, d3;
+  // Seed of the annealing streams of the board.
+  int seed;
+  SearchResult result;
+  bool done;
+  // Whether result came from a ResultCache.
+  bool cached;
+
+  // One slot per annealing restart, merged into result once all are finished.
+  vector<SearchResult> restarts;
+  atomic<int> pending_restarts;
+  // Set to make the restarts still running or queued give up early.
+  atomic<bool> stop;
+
+  Board() {
+    seed = 0;
+    done = false;
+    cached = false;
+    pending_restarts = 0;
+    stop = false;
+  }
+};
+
+// Metropolis acceptance thresholds exp(-loss / temp) for integer point losses.
+// The temperature changes very little over a band of steps, so the table is
+// refreshed once per band instead of calling exp on every step.
+struct AcceptanceTable {
+  static const int size = 64;
+  // Steps between refreshes. Over 1024 steps the default schedule cools by
+  // less than 0.4%.
+  static const int band = 1024;
+  float threshold[size];
+
+  void set_temperature(double temp) {
+    double q = exp(-1 / temp);
+    double t = 1;
+    for (int i = 0; i < size; ++i, t *= q) threshold[i] = t;
+  }
+
+  // Whether to accept a candidate losing `loss` > 0 points, given a uniform
+  // random number r. Losses beyond the table are practically never accepted.
+  bool accept(int loss, float r) const {
+    return loss < size && r < threshold[loss];
+  }
+};
+
+// Watches an annealing run with --schedule=adaptive for having frozen: a whole
+// band of steps without accepting a single worse candidate, while the best has
+// not improved for a while. A frozen run is reheated, or ended once too few
+// steps would be left to cool down again.
+struct Stagnation {
+  enum Action {
+    CONTINUE,
+    REHEAT,
+    END,
+  };
+
+  // Worse candidates seen and accepted in the current band.
+  int worse;
+  int worse_accepted;
+  int last_improvement;
+  // Steps without improvement before a frozen run counts as stuck.
+  int patience;
+  // Temperature halfway through the geometric schedule, and the steps it
+  // takes to cool down from there.
+  double reheat_temp;
+  int cooling_steps;
+
+  explicit Stagnation(const Options &options) {
+    worse = 0;
+    worse_accepted = 0;
+    last_improvement = 0;
+    patience = options.steps * 0.3;
+    reheat_temp = sqrt(options.start_temp * options.final_temp);
+    cooling_steps = options.steps / 2;
+  }
+
+  Action end_band(int step, const Options &options) {
+    bool frozen = worse_accepted == 0;
+    worse = 0;
+    worse_accepted = 0;
+    if (!frozen || step - last_improvement < patience) return CONTINUE;
+    if (options.steps - step < cooling_steps) return END;
+    last_improvement = step;
+    return REHEAT;
+  }
+};
+
+// Anneals a single restart until the schedule ends or *stop becomes set.
+template <class Rng>
+void play_randomly(const Deck &d1, const Deck &d2, const Deck &d3, const Options &options, atomic<bool> *stop,
+                   Rng *annealing_twister, Worker *worker, SearchResult *result) {
+  Checkpoint *checkpoints = worker->checkpoints;
+  checkpoints[0] = initial_checkpoint(d1, d2, d3);
+  StepCounts *counts = &result->counts;
 
-void play_randomly(Deck d1, Deck d2, Deck d3, Twister *annealing_twister) {
   State st;
 
-  double start_temp = 2;
-  double final_temp = 0.1;
+  double start_temp = options.start_temp;
+  double final_temp = options.final_temp;
 
   double temp = start_temp;
 
-  double temp_cooldown = pow(final_temp / start_temp, 1.0 / 200000);
-  while (temp > final_temp) {
-    State cand = st;
-    cand.card_sequence_sz = 0;
-    while (!cand.mutate(annealing_twister)) {}
+  double temp_cooldown = pow(final_temp / start_temp, 1.0 / options.steps);
+  // Each band uses the temperature in its middle.
+  double band_center = pow(temp_cooldown, AcceptanceTable::band / 2);
+  AcceptanceTable acceptance;
+  Stagnation stagnation(options);
+  STAT(Stats &stats = worker->stats; int best_step = 0;)
+  for (int step = 0; (options.adaptive ? step < options.steps : temp > final_temp) && !stop->load(memory_order_relaxed); ++step) {
+    if (step % AcceptanceTable::band == 0) {
+      if (options.adaptive && step > 0) {
+        int action = stagnation.end_band(step, options);
+        if (action == Stagnation::END) break;
+        if (action == Stagnation::REHEAT) temp = stagnation.reheat_temp;
+      }
+      acceptance.set_temperature(temp * band_center);
+    }
+    STAT(if (options.trace_every > 0 && step % options.trace_every == 0) {
+      fprintf(stderr, "trace %d %d %.4f %d %d\n", worker->restart_seed, step, temp, st.points, result->best.points);
+    })
+
+    // Moves before pos are unchanged, so the simulation resumes from there.
+    // A candidate that reproduces st is accepted without a random draw and
+    // changes nothing, so skipping the simulation of the ones recognized in
+    // advance leaves the run as it was. Of options.neighbors candidates the
+    // first with the most points goes on to the acceptance test, a skipped one
+    // standing for st; the best so far is kept in one of two lanes while the
+    // next candidate is played out in the other.
+    State lanes[2];
+    Checkpoint *lane_checkpoints[2] = {worker->candidate_checkpoints, worker->neighbor_checkpoints};
+    int best = -1;
+    int best_points = -1;
+    bool best_is_noop = false;
+    int pos = 0;
+    for (int i = 0; i < options.neighbors; ++i) {
+      State cand = st;
+      int from;
+      while (!cand.mutate(annealing_twister, &from)) {
+        STAT(++stats.mutate_failures);
+      }
+      ++counts->candidates;
+      STAT(++stats.candidates);
+      if (st.is_noop_insert(d1, d2, d3, cand, from, checkpoints)) {
+        ++counts->skipped;
+        if (st.points > best_points) {
+          best_points = st.points;
+          best_is_noop = true;
+        }
+        continue;
+      }
+      int lane = best == 0 ? 1 : 0;
+      lane_checkpoints[lane][from] = checkpoints[from];
+      lanes[lane].play_out(d1, d2, d3, cand, from, lane_checkpoints[lane]);
+      if (lanes[lane].same_moves(st)) ++counts->repeats;
+      STAT(stats.moves_played_out += cand.move_sequence_sz - from;
+           stats.moves_dropped += cand.move_sequence_sz - lanes[lane].move_sequence_sz;)
+      if (lanes[lane].points > best_points) {
+        best = lane;
+        best_points = lanes[lane].points;
+        best_is_noop = false;
+        pos = from;
+      }
+    }
+    if (best_is_noop) {
+      temp *= temp_cooldown;
+      continue;
+    }
+    State &refined = lanes[best];
+    Checkpoint *candidate_checkpoints = lane_checkpoints[best];
+
+    if (refined.points > result->best.points) {
+      refined.record_cards(d1, d2, d3);
+      if (refined.points >= options.target) {
+        result->solutions.push_back(State());
+        result->solutions.back().DeepCopy(refined);
+        if (options.decision) stop->store(true, memory_order_relaxed);
+      }
+      result->best.DeepCopy(refined);
+      stagnation.last_improvement = step;
+      STAT(best_step = step);
+    }
 
-    State refined;
-    refined.play_out(d1, d2, d3, cand);
+    int loss = st.points - refined.points;
+    if (loss > 0) ++stagnation.worse;
+    STAT(if (loss > 0) ++stats.worse[Stats::tenth(step, options.steps)]);
+    if (loss <= 0 || acceptance.accept(loss, annealing_twister->next_float())) {
+      if (loss > 0) ++stagnation.worse_accepted;
+      STAT(if (loss > 0) ++stats.worse_accepted[Stats::tenth(step, options.steps)]);
+      st = refined;
+      memcpy(checkpoints + pos + 1, candidate_checkpoints + pos + 1, (st.move_sequence_sz - pos) * sizeof(Checkpoint));
+    }
+    temp *= temp_cooldown;
+  }
+  STAT(++stats.restarts; ++stats.best_found[Stats::tenth(best_step, options.steps)]);
+}
+
+// Replica exchange: options.replicas chains are annealed side by side, each at
+// its own fixed temperature on a geometric ladder from final_temp up to
+// start_temp. Every sweep gives each chain one Metropolis step; after each
+// epoch of epoch_sweeps sweeps, neighboring levels trade plays under the
+// exchange criterion. So good plays found by the hot chains sink to the cold
+// ones, while the cold chains can be pulled out of local maxima. The chains
+// share the budget of restarts x steps candidates.
+//
+// Each chain advances through an epoch as a pool task of its own, so a board
+// uses up to options.replicas threads. The task finishing an epoch last does
+// the exchanges and schedules the next epoch; no task ever waits for another.
+struct Tempering {
+  static const int epoch_sweeps = 256;
+
+  struct Chain {
+    State st;
+    Checkpoint checkpoints[41];
+    // Only the generator selected by --rng is used.
+    Twister twister;
+    Xoshiro xoshiro;
+    SearchResult result;
+  };
+
+  vector<Chain> chains;
+  // chain[level] is the chain currently at temperature level `level`, and
+  // level[c] the level of chain c.
+  int chain[max_replicas];
+  int level[max_replicas];
+  double beta[max_replicas];
+  AcceptanceTable acceptance[max_replicas];
+  Twister exchange_twister;
+  long long sweeps;
+  long long epoch;
+  // Chains still advancing through the current epoch.
+  atomic<int> pending;
+};
 
-    if (refined.points > best_state.points) {
-      if (refined.points >= 31) refined.print();
-      best_state.DeepCopy(refined);
+// Gives chain c `sweeps` Metropolis steps at the temperature of acceptance.
+template <class Rng>
+void advance_chain(const Deck &d1, const Deck &d2, const Deck &d3, const Options &options, atomic<bool> *stop,
+                   const AcceptanceTable &acceptance, long long sweeps, Tempering::Chain *c, Rng *rng, Worker *worker) {
+  StepCounts *counts = &c->result.counts;
+  Checkpoint *checkpoints = c->checkpoints;
+  Checkpoint *candidate_checkpoints = worker->candidate_checkpoints;
+  State &st = c->st;
+  for (long long sweep = 0; sweep < sweeps && !stop->load(memory_order_relaxed); ++sweep) {
+    State cand = st;
+    int pos;
+    while (!cand.mutate(rng, &pos)) {}
+    ++counts->candidates;
+    if (st.is_noop_insert(d1, d2, d3, cand, pos, checkpoints)) {
+      ++counts->skipped;
+      continue;
+    }
+    State refined;
+    candidate_checkpoints[pos] = checkpoints[pos];
+    refined.play_out(d1, d2, d3, cand, pos, candidate_checkpoints);
+    if (refined.same_moves(st)) ++counts->repeats;
+
+    if (refined.points > c->result.best.points) {
+      refined.record_cards(d1, d2, d3);
+      if (refined.points >= options.target) {
+        c->result.solutions.push_back(State());
+        c->result.solutions.back().DeepCopy(refined);
+        if (options.decision) stop->store(true, memory_order_relaxed);
+      }
+      c->result.best.DeepCopy(refined);
     }
 
-    if (exp((refined.points - st.points) / temp) > annealing_twister->next_float()) {
+    int loss = st.points - refined.points;
+    if (loss <= 0 || acceptance.accept(loss, rng->next_float())) {
       st = refined;
+      memcpy(checkpoints + pos + 1, candidate_checkpoints + pos + 1, (st.move_sequence_sz - pos) * sizeof(Checkpoint));
+    }
+  }
+}
+
+// Alternates between the even and the odd pairs of levels from epoch to epoch.
+void exchange_chains(Tempering *t, int replicas) {
+  for (int level = t->epoch % 2; level + 1 < replicas; level += 2) {
+    int gain = t->chains[t->chain[level + 1]].st.points - t->chains[t->chain[level]].st.points;
+    double x = gain * (t->beta[level] - t->beta[level + 1]);
+    if (x >= 0 || t->exchange_twister.next_float() < exp(x)) {
+      swap(t->chain[level], t->chain[level + 1]);
+      t->level[t->chain[level]] = level;
+      t->level[t->chain[level + 1]] = level + 1;
     }
-    temp *= temp_cooldown;
   }
 }
 
-void play_single_setting(Deck d1, Deck d2, Deck d3, Twister *annealing_twister) {
-  reverse(d1.q, d1.q + d1.q_sz);
-  reverse(d2.q, d2.q + d2.q_sz);
+// Submits one task per chain for the current epoch of t. The last one to
+// finish either starts the next epoch or merges the chains into board->result
+// in chain order and calls on_done.
+void schedule_tempering_epoch(Board *board, const shared_ptr<Tempering> &t, const Options *options, WorkerPool *pool,
+                              const function<void(Board*)> &on_done) {
+  int replicas = options->replicas;
+  long long sweeps = min((long long)Tempering::epoch_sweeps, t->sweeps - t->epoch * Tempering::epoch_sweeps);
+  t->pending = replicas;
+  for (int c = 0; c < replicas; ++c) {
+    pool->submit([board, t, c, sweeps, options, pool, on_done](Worker *worker) {
+      Tempering::Chain *chain = &t->chains[c];
+      const AcceptanceTable &acceptance = t->acceptance[t->level[c]];
+      if (options->xoshiro) {
+        advance_chain(board->d1, board->d2, board->d3, *options, &board->stop, acceptance, sweeps, chain, &chain->xoshiro, worker);
+      } else {
+        advance_chain(board->d1, board->d2, board->d3, *options, &board->stop, acceptance, sweeps, chain, &chain->twister, worker);
+      }
+      if (--t->pending > 0) return;
 
-  for (int i = 0; i < 10; ++i) {
-    play_randomly(d1, d2, d3, annealing_twister);
+      ++t->epoch;
+      if (t->epoch * Tempering::epoch_sweeps < t->sweeps && !board->stop) {
+        exchange_chains(t.get(), options->replicas);
+        schedule_tempering_epoch(board, t, options, pool, on_done);
+        return;
+      }
+      for (int i = 0; i < options->replicas; ++i) board->result.merge(t->chains[i].result);
+      on_done(board);
+    });
   }
 }
 
-void play_randomized_deck(Deck d1, Deck d2, Deck d3, Twister *setup_twister, Twister *annealing_twister) {
-  set<Card> d1s = d1.to_set();
-  set<Card> d2s = d2.to_set();
+void play_tempering(Board *board, int seed, const Options *options, WorkerPool *pool, const function<void(Board*)> &on_done) {
+  int replicas = options->replicas;
+  shared_ptr<Tempering> t(new Tempering);
+  t->chains.resize(replicas);
+  for (int i = 0; i < replicas; ++i) {
+    t->chain[i] = i;
+    t->level[i] = i;
+    double temp = options->final_temp * pow(options->start_temp / options->final_temp, i / (replicas - 1.0));
+    t->beta[i] = 1 / temp;
+    t->acceptance[i].set_temperature(temp);
+    Tempering::Chain &c = t->chains[i];
+    c.checkpoints[0] = initial_checkpoint(board->d1, board->d2, board->d3);
+    if (options->xoshiro) c.xoshiro.init(stream_seed(seed, i));
+    else c.twister.init(stream_seed(seed, i));
+  }
+  t->exchange_twister.init(stream_seed(seed, replicas));
+  t->sweeps = (long long)options->restarts * options->steps / replicas;
+  t->epoch = 0;
+  schedule_tempering_epoch(board, t, options, pool, on_done);
+}
 
-  vector<Card> remaining1;
-  vector<Card> remaining2;
-  for (set<Card>::iterator it = full_deck_set.begin(); it != full_deck_set.end(); ++it) {
-    if (it->value == 0) {
-      if (d1s.find(*it) == d1s.end()) remaining1.push_back(*it);
-    } else if (it->value == 10) {
-      // This deck is set, don't fill it up.
-    } else {
-      if (d2s.find(*it) == d2s.end()) remaining2.push_back(*it);
+// Searches the plays breadth-first by number of cards bought, using
+// Deck::process_move for every transition. Of the checkpoints that have bought
+// the same cards, in whatever order, only the one with the fewest tokens spent
+// is kept, which loses nothing: the remaining cards are the same, and spending
+// fewer tokens never makes a later move impossible. Checkpoints that
+// points_bound shows to be hopeless are not expanded either. With a beam width
+// only that many of the most promising checkpoints per layer are expanded;
+// without one the search is exact.
+void play_beam(const Deck &d1, const Deck &d2, const Deck &d3, const Options &options, atomic<bool> *stop,
+               Worker *worker, SearchResult *result) {
+  const Deck *decks[3] = {&d1, &d2, &d3};
+  vector<vector<BeamNode> > &layers = worker->beam_layers;
+  for (size_t i = 0; i < layers.size(); ++i) layers[i].clear();
+  if (layers.empty()) layers.resize(1);
+  // Stale entries of earlier layers and searches need no clearing: a hit only
+  // counts if the node it points to carries the same key.
+  BeamIndex &index = worker->beam_index;
+  if (index.bits() == 0) index.reset(10);
+
+  BeamNode root;
+  root.cp = initial_checkpoint(d1, d2, d3);
+  root.key = 0;
+  root.parent = -1;
+  root.move = -1;
+  layers[0].push_back(root);
+  int best_layer = 0;
+  int best_node = 0;
+
+  for (size_t depth = 0; !layers[depth].empty() && !stop->load(memory_order_relaxed); ++depth) {
+    if (layers.size() < depth + 2) layers.resize(depth + 2);
+    vector<BeamNode> &layer = layers[depth];
+    vector<BeamNode> &next = layers[depth + 1];
+    if (options.beam_width > 0 && (int)layer.size() > options.beam_width) {
+      // Order is irrelevant for the parents, which are already expanded.
+      // Four tokens cost a round, which is valued at two points. Ranking by
+      // points alone starves the cheap 0-point cards that enable everything
+      // else; on the sample board this weight works clearly best.
+      nth_element(layer.begin(), layer.begin() + options.beam_width, layer.end(), [](const BeamNode &a, const BeamNode &b) {
+        int score_a = 2 * a.cp.points - a.cp.tokens_cost;
+        int score_b = 2 * b.cp.points - b.cp.tokens_cost;
+        if (score_a != score_b) return score_a > score_b;
+        return a.cp.tokens_cost < b.cp.tokens_cost;
+      });
+      layer.resize(options.beam_width);
+    }
+    for (size_t i = 0; i < layer.size(); ++i) {
+      if (layer[i].cp.points > layers[best_layer][best_node].cp.points) {
+        best_layer = depth;
+        best_node = i;
+      }
+    }
+    if (options.decision && layers[best_layer][best_node].cp.points >= options.target) break;
+
+    // Only expand the states that can still beat the best found so far, or in
+    // decision mode reach the target. The best one is kept for the moves that
+    // led to it.
+    int bar = options.decision ? options.target : layers[best_layer][best_node].cp.points + 1;
+    size_t kept = 0;
+    for (size_t i = 0; i < layer.size(); ++i) {
+      bool is_best = best_layer == (int)depth && best_node == (int)i;
+      if (!is_best && points_bound(d2, d3, layer[i].cp) < bar) continue;
+      if (is_best) best_node = kept;
+      layer[kept++] = layer[i];
+    }
+    layer.resize(kept);
+
+    // Room for all children of the layer at a load factor of at most 1/2, up
+    // to 2^22 entries. Past that some transpositions are missed, which only
+    // leaves duplicate nodes in the next layer.
+    int bits = index.bits();
+    while (bits < 22 && (1 << bits) < 20 * (long long)layer.size()) ++bits;
+    if (bits > index.bits()) index.reset(bits);
+
+    for (size_t i = 0; i < layer.size(); ++i) {
+      for (int x = 0; x < 10; ++x) {
+        BeamNode child;
+        child.cp = layer[i].cp;
+        child.parent = i;
+        child.move = x;
+        int d = x / 4;
+        CardId c;
+        if (!decks[d]->process_move(&child.cp.decks[d], x - 4 * d, &child.cp.points, &child.cp.tokens_cost,
+                                    &child.cp.rounds, &child.cp.bonus, &c)) {
+          continue;
+        }
+        child.key = layer[i].key ^ card_zobrist[c];
+        uint64_t j;
+        if (index.find(child.key, &j) && j < next.size() && next[j].key == child.key) {
+          if (child.cp.tokens_cost < next[j].cp.tokens_cost) next[j] = child;
+          continue;
+        }
+        index.store(child.key, next.size());
+        next.push_back(child);
+      }
     }
   }
 
-  d1.fill_up_randomly(25, remaining1, setup_twister);
-  d2.fill_up_randomly(25, remaining2, setup_twister);
+  State st;
+  st.move_sequence_sz = best_layer;
+  for (int depth = best_layer, i = best_node; depth > 0; i = layers[depth--][i].parent) {
+    st.move_sequence[depth - 1] = layers[depth][i].move;
+  }
+  const Checkpoint &cp = layers[best_layer][best_node].cp;
+  st.points = cp.points;
+  st.tokens_cost = cp.tokens_cost;
+  st.rounds = cp.rounds;
+  st.record_cards(d1, d2, d3);
+  if (st.points >= options.target) {
+    result->solutions.push_back(State());
+    result->solutions.back().DeepCopy(st);
+  }
+  result->best.DeepCopy(st);
+}
 
-  best_state = State();
+// Schedules the independent annealing restarts of a board as separate pool
+// tasks, each with its own random stream, a single beam search or the
+// tempering chains. The task that finishes last merges the per-restart
+// results in restart order and calls on_done.
+void play_single_setting(Board *board, int seed, const Options *options, WorkerPool *pool, const function<void(Board*)> &on_done) {
+  if (options->engine == ENGINE_TEMPERING) {
+    play_tempering(board, seed, options, pool, on_done);
+    return;
+  }
+  int restarts = options->engine == ENGINE_ANNEAL ? options->restarts : 1;
+  board->restarts.resize(restarts);
+  board->pending_restarts = restarts;
+  for (int i = 0; i < restarts; ++i) {
+    int restart_seed = stream_seed(seed, i);
+    SearchResult *restart = &board->restarts[i];
+    pool->submit([board, restart, restart_seed, options, on_done](Worker *worker) {
+      worker->restart_seed = restart_seed;
+      if (options->engine == ENGINE_BEAM) {
+        play_beam(board->d1, board->d2, board->d3, *options, &board->stop, worker, restart);
+      } else if (options->xoshiro) {
+        worker->annealing_xoshiro.init(restart_seed);
+        play_randomly(board->d1, board->d2, board->d3, *options, &board->stop, &worker->annealing_xoshiro, worker, restart);
+      } else {
+        worker->annealing_twister.init(restart_seed);
+        play_randomly(board->d1, board->d2, board->d3, *options, &board->stop, &worker->annealing_twister, worker, restart);
+      }
+      if (--board->pending_restarts > 0) return;
 
-  play_single_setting(d1, d2, d3, annealing_twister);
+      for (size_t j = 0; j < board->restarts.size(); ++j) board->result.merge(board->restarts[j]);
+      board->restarts.clear();
+      on_done(board);
+    });
+  }
 }
 
-int main() {
-  Twister setup_twister;
-  setup_twister.init(23590421);
-  Twister annealing_twister;
-  annealing_twister.init(549120939);
+// Stands in for the setup Twister to deal the completion number `index` of a
+// scenario: each draw takes the next digit of index in the mixed radix of the
+// pool sizes, so indices 0 to count_completions() - 1 deal every completion
+// exactly once.
+struct CompletionIndex {
+  long long index;
 
-  parse_full_deck();
+  explicit CompletionIndex(long long i) {
+    index = i;
+  }
+
+  int next_int(int n) {
+    int x = index % n;
+    index /= n;
+    return x;
+  }
+};
+
+// Moves a random selection of n cards of pool to its front, in random order.
+void shuffle_front(CardPool *pool, int n, Twister *rng) {
+  for (int i = 0; i < n && i < pool->size; ++i) swap(pool->ids[i], pool->ids[i + rng->next_int(pool->size - i)]);
+}
+
+// Number of ways to deal the rest of deck up to desired_size from the given
+// number of remaining cards, or limit + 1 if that is larger than limit.
+long long count_completions(const Deck &deck, int desired_size, int remaining, long long limit) {
+  int draws = deck.missing(desired_size);
+  long long n = 1;
+  for (int i = 0; i < draws && remaining > 0; ++i, --remaining) {
+    n *= remaining;
+    if (n > limit) return limit + 1;
+  }
+  return n;
+}
+
+// Queues are consumed from the back.
+void reverse_queues(Board *board) {
+  reverse(board->d1.q, board->d1.q + board->d1.q_sz);
+  reverse(board->d2.q, board->d2.q + board->d2.q_sz);
+}
+
+// remaining1 and remaining2 are the cards missing from d1 and d2.
+// Rng is Twister or CompletionIndex.
+template <class Rng>
+void randomize_deck(const Deck &d1, const Deck &d2, const Deck &d3, const CardPool &remaining1, const CardPool &remaining2,
+                    Rng *setup_twister, Board *board) {
+  board->d1 = d1;
+  board->d2 = d2;
+  board->d3 = d3;
+
+  // The 10-point deck is set, don't fill it up.
+  board->d1.fill_up_randomly(25, remaining1, setup_twister);
+  board->d2.fill_up_randomly(25, remaining2, setup_twister);
+  reverse_queues(board);
+}
+
+// Like randomize_deck, but whole levels of full_deck are shuffled and the
+// cards not known yet are dealt in that order, so every board takes the same
+// draws whatever the scenario: once another card is revealed, the board drawn
+// next is unchanged if it had dealt that card next. Seeded with board_seed, it
+// then gets the same result too, which a result cache can reuse.
+void randomize_deck_by_level(const Deck &d1, const Deck &d2, const Deck &d3, Twister *setup_twister, Board *board) {
+  CardPool order1, order2;
+  full_deck_level[0].append_to(&order1);
+  full_deck_level[1].append_to(&order2);
+  shuffle_front(&order1, order1.size, setup_twister);
+  shuffle_front(&order2, order2.size, setup_twister);
+  board->d1 = d1;
+  board->d2 = d2;
+  board->d3 = d3;
+  board->d1.fill_up(25, order1);
+  board->d2.fill_up(25, order2);
+  reverse_queues(board);
+}
+
+// Annealing seed of a board, derived from its cards so that a board gets the
+// same play whichever scenario and position it is dealt for.
+int board_seed(const Board &board, int annealing_seed) {
+  uint64_t h = mix64(annealing_seed);
+  const Deck *decks[3] = {&board.d1, &board.d2, &board.d3};
+  for (int d = 0; d < 3; ++d) {
+    for (int i = 0; i < decks[d]->table_sz; ++i) h = mix64(h ^ decks[d]->table[i]);
+    h = mix64(h ^ 0x100);
+    for (int i = 0; i < decks[d]->q_sz; ++i) h = mix64(h ^ decks[d]->q[i]);
+    h = mix64(h ^ 0x200);
+  }
+  return h & 0x7FFFFFFF;
+}
+
+// Board results kept in a memory-mapped file across runs. Records are keyed by
+// a 128-bit hash of the cards of the board in order, its annealing seed and
+// every option that affects the search. They hold the moves of the best play
+// and of up to max_solutions solutions, from which the plays are rebuilt.
+// With a cache, boards are dealt and seeded independently of the scenario, so
+// the boards of a rerun that survive another revealed card are found again
+// (see randomize_deck_by_level). The table has a fixed number of slots with linear probing;
+// once it is full, new results are simply not remembered. find and store may
+// be called from several threads, so estimates driven from different threads
+// can share one cache. Other processes are kept out by an exclusive lock on
+// the file, held while it is mapped.
+class ResultCache {
+  public:
+  static const int max_solutions = 4;
+
+  ResultCache() {
+    fd_ = -1;
+    map_ = NULL;
+    records_ = NULL;
+  }
+
+  ~ResultCache() {
+    if (map_ != NULL) munmap(map_, file_size());
+    if (fd_ >= 0) close(fd_);
+  }
+
+  // Opens or creates the file. Returns false if that fails, if the file exists
+  // but is not a cache, or if another process has it open.
+  bool open(const char *path) {
+    int fd = ::open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) return false;
+    struct stat st;
+    bool ok = flock(fd, LOCK_EX | LOCK_NB) == 0 && fstat(fd, &st) == 0 &&
+              (st.st_size == 0 ? ftruncate(fd, file_size()) == 0 : st.st_size == (off_t)file_size());
+    void *p = ok ? mmap(NULL, file_size(), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+    if (p == MAP_FAILED) {
+      close(fd);
+      return false;
+    }
+    Header *header = static_cast<Header*>(p);
+    if (st.st_size == 0) memcpy(header->magic, magic, sizeof(header->magic));
+    if (memcmp(header->magic, magic, sizeof(header->magic)) != 0) {
+      munmap(p, file_size());
+      close(fd);
+      return false;
+    }
+    fd_ = fd;
+    map_ = p;
+    records_ = reinterpret_cast<Record*>(header + 1);
+    return true;
+  }
+
+  // Fills in *result and returns true if the board was seen before.
+  bool find(const Board &board, int seed, const Options &options, SearchResult *result) const {
+    Key key = make_key(board, seed, options);
+    lock_guard<mutex> lock(mu_);
+    for (int i = 0; i < slots; ++i) {
+      const Record &r = records_[(key.hi + i) & (slots - 1)];
+      if (r.key.lo == 0) return false;
+      if (r.key.lo != key.lo || r.key.hi != key.hi) continue;
+      replay(board, r.best, &result->best);
+      for (int j = 0; j < r.solutions_sz; ++j) {
+        result->solutions.push_back(State());
+        replay(board, r.solutions[j], &result->solutions.back());
+      }
+      return true;
+    }
+    return false;
+  }
+
+  void store(const Board &board, int seed, const Options &options, const SearchResult &result) {
+    if ((int)result.solutions.size() > max_solutions) return;
+    Key key = make_key(board, seed, options);
+    lock_guard<mutex> lock(mu_);
+    for (int i = 0; i < slots; ++i) {
+      Record &r = records_[(key.hi + i) & (slots - 1)];
+      if (r.key.lo != 0 && (r.key.lo != key.lo || r.key.hi != key.hi)) continue;
+      copy_moves(result.best, &r.best);
+      r.solutions_sz = result.solutions.size();
+      for (int j = 0; j < r.solutions_sz; ++j) copy_moves(result.solutions[j], &r.solutions[j]);
+      r.key = key;
+      return;
+    }
+  }
+
+  private:
+  struct Key {
+    uint64_t lo;
+    uint64_t hi;
+  };
+
+  struct Moves {
+    char moves[40];
+    int sz;
+  };
+
+  struct Record {
+    // lo is never 0 for a used record.
+    Key key;
+    Moves best;
+    Moves solutions[max_solutions];
+    int solutions_sz;
+  };
+
+  struct Header {
+    char magic[8];
+    char padding[56];
+  };
+
+  static const int slots = 1 << 16;
+  static const char magic[9];
+
+  static size_t file_size() {
+    return sizeof(Header) + slots * sizeof(Record);
+  }
+
+  // Two differently seeded hashes of everything the search depends on.
+  static Key make_key(const Board &board, int seed, const Options &options) {
+    uint64_t words[] = {
+      (uint32_t)seed, (uint64_t)options.engine, (uint64_t)options.restarts, (uint64_t)options.steps,
+      (uint64_t)(options.start_temp * 1e9), (uint64_t)(options.final_temp * 1e9), (uint64_t)options.target,
+      (uint64_t)options.decision, (uint64_t)options.neighbors, (uint64_t)options.xoshiro, (uint64_t)options.adaptive,
+      (uint64_t)options.beam_width, (uint64_t)options.replicas,
+    };
+    Key key;
+    key.lo = 1;
+    key.hi = 2;
+    int n = sizeof(words) / sizeof(words[0]);
+    for (int i = 0; i < n; ++i) mix(words[i], &key);
+    const Deck *decks[3] = {&board.d1, &board.d2, &board.d3};
+    for (int d = 0; d < 3; ++d) {
+      mix(decks[d]->table_sz | (uint64_t)decks[d]->q_sz << 8, &key);
+      for (int i = 0; i < decks[d]->table_sz; ++i) mix(decks[d]->table[i], &key);
+      for (int i = 0; i < decks[d]->q_sz; ++i) mix(decks[d]->q[i], &key);
+    }
+    key.lo |= 1;
+    return key;
+  }
+
+  static void mix(uint64_t word, Key *key) {
+    key->lo = mix64(key->lo ^ word) + 0x9E3779B97F4A7C15ULL;
+    key->hi = mix64(key->hi + word * 0xC2B2AE3D27D4EB4FULL);
+  }
+
+  static void copy_moves(const State &st, Moves *m) {
+    memcpy(m->moves, st.move_sequence, sizeof(m->moves));
+    m->sz = st.move_sequence_sz;
+  }
+
+  // Rebuilds the play from its (fully playable) moves.
+  static void replay(const Board &board, const Moves &m, State *st) {
+    State cand;
+    memcpy(cand.move_sequence, m.moves, sizeof(cand.move_sequence));
+    cand.move_sequence_sz = m.sz;
+    Checkpoint checkpoints[41];
+    checkpoints[0] = initial_checkpoint(board.d1, board.d2, board.d3);
+    st->play_out(board.d1, board.d2, board.d3, cand, 0, checkpoints);
+    st->record_cards(board.d1, board.d2, board.d3);
+  }
 
+  // The open file, whose lock lasts as long as the descriptor.
+  int fd_;
+  void *map_;
+  Record *records_;
+  mutable mutex mu_;
+};
+
+const char ResultCache::magic[9] = "SPLCACH1";
+
+// Confidence interval of a likelihood, in percent.
+struct Interval {
+  double low;
+  double high;
+};
+
+// 95% Wilson score interval of the likelihood after observing `successes`
+// out of n boards. Unlike the normal approximation it stays meaningful when
+// none or all of the boards are solvable.
+Interval wilson_interval(int successes, int n) {
+  const double z = 1.959964;
+  double p = successes / static_cast<double>(n);
+  double denominator = 1 + z * z / n;
+  double center = (p + z * z / (2 * n)) / denominator;
+  double half = z * sqrt(p * (1 - p) / n + z * z / (4.0 * n * n)) / denominator;
+  Interval ci;
+  ci.low = 100 * max(0.0, center - half);
+  ci.high = 100 * min(1.0, center + half);
+  return ci;
+}
+
+// The 95% confidence interval of the likelihood when sampling (completions is
+// 0), or the range the exact likelihood can still end up in when successes of
+// n out of all completions are known. Before any board it can be anything.
+Interval likelihood_interval(int successes, int n, int completions) {
+  if (n == 0) {
+    Interval all;
+    all.low = 0;
+    all.high = 100;
+    return all;
+  }
+  if (completions == 0) return wilson_interval(successes, n);
+  Interval range;
+  range.low = 100.0 * successes / completions;
+  range.high = 100.0 * (successes + completions - n) / completions;
+  return range;
+}
+
+// Sequential stopping rule for sampling boards.
+bool should_stop(const Options &options, int n, const Interval &ci) {
+  if (options.ci_width <= 0 || n < options.min_boards) return false;
+  if (ci.high - ci.low < options.ci_width) return true;
+  return ci.low > options.baseline || ci.high < options.baseline;
+}
+
+// Cards known in advance, split into the three decks.
+struct Scenario {
   Deck d1, d2, d3;
-  while (true) {
+};
+
+// Lines of an input file. A regular file is mapped into memory and split in
+// place; pipes and sockets are read line by line so that interactive clients
+// get their replies before sending more.
+class LineReader {
+  public:
+  explicit LineReader(FILE *f) {
+    f_ = f;
+    data_ = NULL;
+    size_ = 0;
+    pos_ = 0;
+    struct stat st;
+    int fd = fileno(f);
+    off_t offset = lseek(fd, 0, SEEK_CUR);
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || offset < 0 || st.st_size == 0) return;
+    void *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED) return;
+    data_ = static_cast<const char*>(p);
+    size_ = st.st_size;
+    pos_ = min((size_t)offset, size_);
+  }
+
+  ~LineReader() {
+    if (data_ != NULL) munmap(const_cast<char*>(data_), size_);
+  }
+
+  // Points [*begin, *end) at the next line, without its newline. Returns
+  // false at the end of the input.
+  bool next(const char **begin, const char **end) {
+    if (data_ == NULL) {
+      if (fgets(line_, sizeof(line_), f_) == NULL) return false;
+      *begin = line_;
+      *end = line_ + strlen(line_);
+      return true;
+    }
+    if (pos_ == size_) return false;
+    const char *p = data_ + pos_;
+    const char *newline = static_cast<const char*>(memchr(p, '\n', size_ - pos_));
+    *begin = p;
+    *end = newline != NULL ? newline : data_ + size_;
+    pos_ = newline != NULL ? newline + 1 - data_ : size_;
+    return true;
+  }
+
+  private:
+  FILE *f_;
+  const char *data_;
+  size_t size_;
+  size_t pos_;
+  char line_[100];
+};
+
+// Adds the cards read from in to scenario, ignoring lines that are not cards.
+// In batch mode a line starting with "---" ends the scenario. Returns false if
+// the input ended before any card or separator was read. Cards that are not
+// in full_deck, repeated or do not fit their deck make *error non-empty; the
+// rest of the scenario is still read so that the next one starts in place.
+bool read_scenario(LineReader *in, bool batch, Scenario *scenario, string *error) {
+  error->clear();
+  bool any = false;
+  const char *line, *end;
+  while (in->next(&line, &end)) {
+    if (batch && end - line >= 3 && strncmp(line, "---", 3) == 0) return true;
+
     Card c;
-    if (!c.read()) break;
-    if (!full_deck_set.count(c)) {
-      fprintf(stderr, "unrecognized card %s\n", c.ToString().c_str());
-      exit(1);
+    if (!c.read_from_string(line, end)) continue;
+    any = true;
+    if (!error->empty()) continue;
+    while (end > line && (end[-1] == '\n' || end[-1] == '\r')) --end;
+    c.id = find_card_id(c);
+    if (c.id == -1) {
+      *error = "unrecognized card " + string(line, end);
+      continue;
+    }
+
+    int level = card_level(c);
+    Deck *deck = level == 0 ? &scenario->d1 : level == 2 ? &scenario->d3 : &scenario->d2;
+    if (deck->contains(c.id)) {
+      *error = "repeated card " + string(line, end);
+    } else if (!deck->add_card(c.id)) {
+      *error = "too many cards of the level of " + string(line, end);
     }
+  }
+  return any;
+}
 
-    if (c.value == 0) {
-      d1.add_card(c);
-    } else if (c.value == 10) {
-      d3.add_card(c);
+// Solvability likelihood estimate of one scenario. Boards are drawn in order
+// from the setup stream, annealed on a pool that may be shared with other
+// estimates, and folded into the estimate in board order, which keeps the
+// result identical for a given seed regardless of how work was scheduled.
+class Estimate {
+  public:
+  // cache may be NULL.
+  Estimate(const Scenario &scenario, const Options *options, WorkerPool *pool, ResultCache *cache) {
+    scenario_ = scenario;
+    options_ = options;
+    pool_ = pool;
+    cache_ = cache;
+    setup_twister_.init(options->setup_seed);
+    (full_deck_level[0] - scenario.d1.cards()).append_to(&remaining1_);
+    (full_deck_level[1] - scenario.d2.cards()).append_to(&remaining2_);
+    long long limit = options->boards;
+    long long completions = count_completions(scenario.d1, 25, remaining1_.size, limit);
+    if (completions <= limit) completions *= count_completions(scenario.d2, 25, remaining2_.size, limit);
+    // Otherwise boards are sampled.
+    completions_ = options->enumerate && completions <= limit ? completions : 0;
+    scheduled_ = 0;
+    boards_done_ = 0;
+    at_target_ = 0;
+    max_points_ = 0;
+    stopped_ = false;
+    cancelled_ = false;
+  }
+
+  bool wants_board() const {
+    return !stopped_ && !cancelled_ && scheduled_ < (enumerated() ? completions_ : options_->boards);
+  }
+
+  bool finished() const {
+    return !wants_board() && boards_.empty();
+  }
+
+  // Boards scheduled but not collected yet.
+  int in_flight() const {
+    return boards_.size();
+  }
+
+  void schedule_board() {
+    Board *board;
+    {
+      lock_guard<mutex> lock(mu_);
+      boards_.emplace_back();
+      board = &boards_.back();
+      board->stop = cancelled_.load();
+    }
+    deal_board(board);
+    if (cache_ != NULL && cache_->find(*board, board->seed, *options_, &board->result)) {
+      board->cached = true;
+      board->done = true;
+      return;
+    }
+    function<void(Board*)> on_done = [this](Board *b) {
+      lock_guard<mutex> lock(mu_);
+      b->done = true;
+      cv_.notify_all();
+    };
+    play_single_setting(board, board->seed, options_, pool_, on_done);
+  }
+
+  // Deals the next board and sets its annealing seed, without scheduling it.
+  // Without a cache, boards are dealt and seeded as in earlier versions.
+  void deal_board(Board *board) {
+    if (enumerated()) {
+      CompletionIndex index(scheduled_);
+      randomize_deck(scenario_.d1, scenario_.d2, scenario_.d3, remaining1_, remaining2_, &index, board);
+    } else if (cache_ != NULL) {
+      randomize_deck_by_level(scenario_.d1, scenario_.d2, scenario_.d3, &setup_twister_, board);
     } else {
-      d2.add_card(c);
+      randomize_deck(scenario_.d1, scenario_.d2, scenario_.d3, remaining1_, remaining2_, &setup_twister_, board);
     }
+    if (cache_ != NULL) board->seed = board_seed(*board, options_->annealing_seed);
+    else board->seed = stream_seed(options_->annealing_seed, scheduled_);
+    ++scheduled_;
   }
 
-  int at_31 = 0;
-  int mx = 0;
-  for (int i = 0; i < 50; ++i) {
-    play_randomized_deck(d1, d2, d3, &setup_twister, &annealing_twister);
-    if (best_state.points >= 31) ++at_31;
-    if (best_state.points > mx) mx = best_state.points;
-    double ratio = 100.0 * at_31 / static_cast<double>(i + 1);
-    printf("\rIter %d, Maximum: %d, Solvability likelihood: %.2lf %%, lift vs random board %.2lf", i+1, mx, ratio, ratio / 3.7);
-    fflush(stdout);
+  // Waits for the oldest board in flight and folds it into the estimate.
+  // When this makes the stopping rule fire, the boards still in flight are
+  // cancelled and discarded. Returns the folded result, which stays valid
+  // until the next call.
+  // After cancel, all boards are discarded instead and no result is folded.
+  const SearchResult &collect() {
+    wait(&boards_.front());
+    if (cancelled_) {
+      discard_boards();
+      last_.solutions.clear();
+      return last_;
+    }
+    Board &board = boards_.front();
+    if (cache_ != NULL && !board.cached) cache_->store(board, board.seed, *options_, board.result);
+    last_.best.DeepCopy(board.result.best);
+    last_.solutions.swap(board.result.solutions);
+    last_.counts = board.result.counts;
+    {
+      lock_guard<mutex> lock(mu_);
+      boards_.pop_front();
+    }
+
+    ++boards_done_;
+    if (last_.best.points >= options_->target) ++at_target_;
+    if (last_.best.points > max_points_) max_points_ = last_.best.points;
+    counts_.add(last_.counts);
+
+    if (!enumerated() && boards_done_ < options_->boards && should_stop(*options_, boards_done_, interval())) {
+      stopped_ = true;
+      discard_boards();
+    }
+    return last_;
+  }
+
+  // Makes the boards in flight give up and schedules no more. May be called
+  // from any thread; the estimate then finishes after the next collect.
+  void cancel() {
+    cancelled_ = true;
+    lock_guard<mutex> lock(mu_);
+    for (size_t i = 0; i < boards_.size(); ++i) boards_[i].stop = true;
+  }
+
+  bool cancelled() const { return cancelled_; }
+  // Whether every completion of the scenario is evaluated.
+  bool enumerated() const { return completions_ > 0; }
+  // Whether the likelihood is exact: every completion is evaluated by a search
+  // that finds a winning play whenever there is one.
+  bool exact() const {
+    return enumerated() && options_->engine == ENGINE_BEAM && options_->beam_width == 0;
+  }
+
+  int boards_done() const { return boards_done_; }
+  int at_target() const { return at_target_; }
+  int max_points() const { return max_points_; }
+  bool stopped() const { return stopped_; }
+  const StepCounts &counts() const { return counts_; }
+
+  double likelihood() const {
+    return boards_done_ > 0 ? 100.0 * at_target_ / boards_done_ : 0;
+  }
+
+  Interval interval() const {
+    return likelihood_interval(at_target_, boards_done_, completions_);
+  }
+
+  int completions() const { return completions_; }
+
+  private:
+  void wait(Board *board) {
+    unique_lock<mutex> lock(mu_);
+    while (!board->done) cv_.wait(lock);
+  }
+
+  void discard_boards() {
+    unique_lock<mutex> lock(mu_);
+    for (size_t i = 0; i < boards_.size(); ++i) boards_[i].stop = true;
+    for (size_t i = 0; i < boards_.size(); ++i) {
+      while (!boards_[i].done) cv_.wait(lock);
+    }
+    boards_.clear();
+  }
+
+  Scenario scenario_;
+  ResultCache *cache_;
+  // Cards to fill up the decks of scenario_ with, the same for every board.
+  CardPool remaining1_;
+  CardPool remaining2_;
+  const Options *options_;
+  WorkerPool *pool_;
+  Twister setup_twister_;
+  // Number of completions evaluated one by one, 0 when sampling.
+  int completions_;
+  int scheduled_;
+  deque<Board> boards_;
+  mutex mu_;
+  condition_variable cv_;
+  SearchResult last_;
+
+  int boards_done_;
+  int at_target_;
+  int max_points_;
+  bool stopped_;
+  atomic<bool> cancelled_;
+  StepCounts counts_;
+};
+
+// Estimate of one scenario running in the background, as --serve uses it and
+// for embedding the solver in other programs (build with -DSPLENDOR_NO_MAIN and
+// call parse_full_deck first). The progress can be polled without locking
+// while the workers run, and the estimate can be cancelled at any time.
+class AsyncEstimate {
+  public:
+  // Called on the estimate's own thread with the result of every board folded
+  // in, and once with NULL when the estimate is finished.
+  typedef function<void(const Estimate&, const SearchResult*)> Observer;
+
+  struct Snapshot {
+    int boards_done;
+    int at_target;
+    int max_points;
+    // Whether the estimate is complete, stopped early or cancelled.
+    bool finished;
+    bool stopped;
+    bool cancelled;
+    // Number of completions evaluated one by one, 0 when sampling.
+    int completions;
+
+    double likelihood() const {
+      return boards_done > 0 ? 100.0 * at_target / boards_done : 0;
+    }
+
+    Interval interval() const {
+      return likelihood_interval(at_target, boards_done, completions);
+    }
+  };
+
+  // Starts evaluating the scenario on pool, which may be shared with other
+  // estimates. options, pool and cache (which may be NULL) must outlive this.
+  AsyncEstimate(const Scenario &scenario, const Options *options, WorkerPool *pool, ResultCache *cache,
+                const Observer &observer = Observer())
+      : estimate_(scenario, options, pool, cache), observer_(observer) {
+    snapshot_ = 0;
+    window_ = 2 * pool->size();
+    thread_ = thread([this]() { run(); });
+  }
+
+  // Cancels the estimate unless it finished and waits for the workers.
+  ~AsyncEstimate() {
+    cancel();
+    wait();
+  }
+
+  Snapshot snapshot() const {
+    uint64_t bits = snapshot_.load(memory_order_acquire);
+    Snapshot s;
+    s.boards_done = bits & 0xFFFFFF;
+    s.at_target = (bits >> 24) & 0xFFFFFF;
+    s.max_points = (bits >> 48) & 0xFF;
+    s.finished = (bits >> 56) & 1;
+    s.stopped = (bits >> 57) & 1;
+    s.cancelled = (bits >> 58) & 1;
+    s.completions = estimate_.completions();
+    return s;
+  }
+
+  // Returns immediately; boards in flight give up within a few steps.
+  void cancel() {
+    estimate_.cancel();
+  }
+
+  // Blocks until the estimate is finished.
+  void wait() {
+    if (thread_.joinable()) thread_.join();
+  }
+
+  private:
+  void run() {
+    while (!estimate_.finished()) {
+      while (estimate_.wants_board() && estimate_.in_flight() < window_) estimate_.schedule_board();
+      if (estimate_.in_flight() == 0) continue;
+      const SearchResult &result = estimate_.collect();
+      publish(false);
+      if (observer_ && !estimate_.cancelled()) observer_(estimate_, &result);
+    }
+    if (observer_) observer_(estimate_, NULL);
+    publish(true);
+  }
+
+  // Snapshots are packed into one word so that readers see consistent counts.
+  // Counts are capped at 2^24 boards.
+  void publish(bool finished) {
+    uint64_t bits = min(estimate_.boards_done(), 0xFFFFFF) | (uint64_t)min(estimate_.at_target(), 0xFFFFFF) << 24 |
+                    (uint64_t)min(estimate_.max_points(), 0xFF) << 48 | (uint64_t)finished << 56 |
+                    (uint64_t)estimate_.stopped() << 57 | (uint64_t)estimate_.cancelled() << 58;
+    snapshot_.store(bits, memory_order_release);
+  }
+
+  Estimate estimate_;
+  Observer observer_;
+  int window_;
+  atomic<uint64_t> snapshot_;
+  thread thread_;
+};
+
+// Formats progress and results on out, as text or as JSON lines. Output
+// is buffered and only flushed with progress updates (rate-limited by
+// --progress_ms) and results.
+class Reporter {
+  public:
+  Reporter(const Options *options, FILE *out) : out_(out) {
+    options_ = options;
+    has_progress_ = false;
+    progress_skipped_ = false;
+  }
+
+  // A scenario of a batch that could not be read.
+  void error(int scenario, const string &message) {
+    if (!options_->json) {
+      out_.append("Scenario %d: error: %s\n", scenario, message.c_str());
+      out_.flush();
+      return;
+    }
+    out_.append("{\"type\":\"error\",\"scenario\":%d,\"message\":\"", scenario);
+    for (size_t i = 0; i < message.size(); ++i) {
+      unsigned char c = message[i];
+      if (c == '"' || c == '\\') out_.append("\\%c", c);
+      else if (c < 0x20) out_.append("\\u%04x", c);
+      else out_.append("%c", c);
+    }
+    out_.append("\"}\n");
+    out_.flush();
+  }
+
+  void solution(int scenario, int board, const State &st) {
+    if (!options_->print_solutions) return;
+    if (options_->json) {
+      out_.append("{\"type\":\"solution\",\"scenario\":%d,\"board\":%d,", scenario, board);
+      st.print_json_fields(&out_);
+      out_.append("}\n");
+    } else if (!options_->batch) {
+      st.print(&out_);
+    }
+  }
+
+  void progress(int scenario, const Estimate &e) {
+    if (options_->batch && !options_->json) return;
+    chrono::steady_clock::time_point now = chrono::steady_clock::now();
+    progress_skipped_ = has_progress_ && now - last_progress_ < chrono::milliseconds(options_->progress_ms);
+    if (progress_skipped_) return;
+    has_progress_ = true;
+    last_progress_ = now;
+    write_progress(scenario, e);
+    out_.flush();
+  }
+
+  void result(int scenario, const Estimate &e) {
+    Interval ci = e.interval();
+    double lift = e.likelihood() / options_->baseline;
+    if (options_->json) {
+      out_.append("{\"type\":\"result\",");
+      write_stats(scenario, e);
+      out_.append(",\"lift\":%.4f,\"stopped\":%s,\"cancelled\":%s,\"enumerated\":%s,\"exact\":%s", lift,
+                  e.stopped() ? "true" : "false", e.cancelled() ? "true" : "false", e.enumerated() ? "true" : "false",
+                  e.exact() ? "true" : "false");
+      if (options_->step_stats) {
+        const StepCounts &c = e.counts();
+        out_.append(",\"candidates\":%lld,\"skipped\":%lld,\"repeats\":%lld", c.candidates, c.skipped, c.repeats);
+      }
+      out_.append("}\n");
+    } else if (options_->batch && e.enumerated()) {
+      out_.append("Scenario %d: boards %d, solvable %d, maximum %d, likelihood %.2lf %% (%s), lift %.2lf\n",
+                  scenario, e.boards_done(), e.at_target(), e.max_points(), e.likelihood(),
+                  e.exact() ? "exact" : "all completions", lift);
+    } else if (options_->batch) {
+      out_.append("Scenario %d: boards %d, solvable %d, maximum %d, likelihood %.2lf %% (95%% CI %.2lf-%.2lf), lift %.2lf\n",
+                  scenario, e.boards_done(), e.at_target(), e.max_points(), e.likelihood(), ci.low, ci.high, lift);
+    } else {
+      if (progress_skipped_) write_progress(scenario, e);
+      out_.append("\n");
+      if (e.stopped()) out_.append("Stopped early, the confidence interval is conclusive\n");
+      if (e.exact()) out_.append("Every completion of the hidden cards was evaluated, the likelihood is exact\n");
+      else if (e.enumerated()) out_.append("Every completion of the hidden cards was evaluated once\n");
+    }
+    if (options_->step_stats && !options_->json) {
+      const StepCounts &c = e.counts();
+      double n = c.candidates > 0 ? c.candidates : 1;
+      out_.append("Annealing candidates: %lld, no-op inserts skipped: %lld (%.2lf %%), played out to no change: %lld (%.2lf %%)\n",
+                  c.candidates, c.skipped, 100 * c.skipped / n, c.repeats, 100 * c.repeats / n);
+    }
+    out_.flush();
+  }
+
+  private:
+  void write_progress(int scenario, const Estimate &e) {
+    if (options_->json) {
+      out_.append("{\"type\":\"progress\",");
+      write_stats(scenario, e);
+      out_.append("}\n");
+    } else {
+      double ratio = e.likelihood();
+      Interval ci = e.interval();
+      out_.append("\rIter %d, Maximum: %d, Solvability likelihood: %.2lf %% (%s %.2lf-%.2lf), lift vs random board %.2lf",
+                  e.boards_done(), e.max_points(), ratio, e.enumerated() ? "range" : "95% CI", ci.low, ci.high,
+                  ratio / options_->baseline);
+    }
+  }
+
+  void write_stats(int scenario, const Estimate &e) {
+    Interval ci = e.interval();
+    out_.append("\"scenario\":%d,\"boards\":%d,\"solvable\":%d,\"maximum\":%d,"
+                "\"likelihood\":%.4f,\"ci_low\":%.4f,\"ci_high\":%.4f",
+                scenario, e.boards_done(), e.at_target(), e.max_points(), e.likelihood(), ci.low, ci.high);
+  }
+
+  const Options *options_;
+  Writer out_;
+  bool has_progress_;
+  // Whether the latest update was held back by the rate limit.
+  bool progress_skipped_;
+  chrono::steady_clock::time_point last_progress_;
+};
+
+// A scenario read but not reported yet: its estimate, or the reason it could
+// not be read.
+struct ScenarioRun {
+  unique_ptr<Estimate> estimate;
+  string error;
+};
+
+// Evaluates the scenarios read from `in` in order. Boards of later scenarios
+// are scheduled as soon as earlier ones have all of theirs in flight, keeping
+// two boards per thread queued so that the pool stays busy across scenarios.
+void run_scenarios(FILE *in, FILE *out, const Options &options, WorkerPool *pool, ResultCache *cache) {
+  LineReader reader(in);
+  const int window = 2 * pool->size();
+  deque<ScenarioRun> active;
+  bool input_done = false;
+  int scenarios = 0;
+  int reported = 0;
+  Reporter reporter(&options, out);
+
+  while (true) {
+    int in_flight = 0;
+    for (size_t i = 0; i < active.size(); ++i) {
+      if (active[i].estimate) in_flight += active[i].estimate->in_flight();
+    }
+    while (in_flight < window) {
+      Estimate *next = NULL;
+      for (size_t i = 0; i < active.size() && next == NULL; ++i) {
+        Estimate *e = active[i].estimate.get();
+        if (e != NULL && e->wants_board()) next = e;
+      }
+      if (next == NULL) {
+        if (input_done) break;
+        Scenario scenario;
+        string error;
+        // A single scenario is evaluated even if the input is empty.
+        if (!read_scenario(&reader, options.batch, &scenario, &error) && (options.batch || scenarios > 0)) {
+          input_done = true;
+          break;
+        }
+        if (!options.batch) input_done = true;
+        if (!error.empty() && !options.batch) {
+          fprintf(stderr, "%s\n", error.c_str());
+          exit(1);
+        }
+        // A batch goes on past a bad scenario, which is reported in its turn.
+        active.push_back(ScenarioRun());
+        if (error.empty()) active.back().estimate.reset(new Estimate(scenario, &options, pool, cache));
+        else active.back().error = error;
+        ++scenarios;
+        continue;
+      }
+      next->schedule_board();
+      ++in_flight;
+    }
+    if (active.empty()) break;
+
+    Estimate *e = active.front().estimate.get();
+    if (e == NULL) {
+      reporter.error(++reported, active.front().error);
+      active.pop_front();
+      continue;
+    }
+    if (e->in_flight() > 0) {
+      const SearchResult &result = e->collect();
+      for (size_t j = 0; j < result.solutions.size(); ++j) {
+        reporter.solution(reported + 1, e->boards_done(), result.solutions[j]);
+      }
+      reporter.progress(reported + 1, *e);
+    }
+    if (!e->finished()) continue;
+
+    reporter.result(++reported, *e);
+    active.pop_front();
+  }
+}
+
+// Evaluates the scenarios of a client one at a time in the background, so that
+// its input is read on meanwhile: the next scenario, or the end of the input,
+// cancels the one being evaluated, whose result then covers the boards done so
+// far. Progress, solutions and results are written from the estimate's thread,
+// errors only while no estimate runs.
+void serve_scenarios(FILE *in, FILE *out, const Options &options, WorkerPool *pool, ResultCache *cache) {
+  LineReader reader(in);
+  Reporter reporter(&options, out);
+  unique_ptr<AsyncEstimate> current;
+  int scenarios = 0;
+  while (true) {
+    Scenario scenario;
+    string error;
+    bool more = read_scenario(&reader, true, &scenario, &error);
+    // Cancels the scenario the client has moved past and waits for its result.
+    current.reset();
+    if (!more) break;
+    int n = ++scenarios;
+    if (!error.empty()) {
+      reporter.error(n, error);
+      continue;
+    }
+    current.reset(new AsyncEstimate(scenario, &options, pool, cache, [&reporter, n](const Estimate &e, const SearchResult *result) {
+      if (result == NULL) {
+        reporter.result(n, e);
+        return;
+      }
+      for (size_t j = 0; j < result->solutions.size(); ++j) reporter.solution(n, e.boards_done(), result->solutions[j]);
+      reporter.progress(n, e);
+    }));
+  }
+}
+
+// Evaluates the scenarios of one client after another on a resident pool.
+// Returns only if the socket cannot be set up.
+void serve(const Options &options, WorkerPool *pool, ResultCache *cache) {
+  // Clients that hang up must not take the server down.
+  signal(SIGPIPE, SIG_IGN);
+  if (strcmp(options.serve, "-") == 0) {
+    serve_scenarios(stdin, stdout, options, pool, cache);
+    return;
+  }
+  sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(options.serve) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Socket path too long: %s\n", options.serve);
+    return;
+  }
+  strcpy(addr.sun_path, options.serve);
+  // Only a socket left behind by an earlier server is replaced.
+  struct stat st;
+  if (lstat(options.serve, &st) == 0) {
+    if (!S_ISSOCK(st.st_mode)) {
+      fprintf(stderr, "Cannot listen on %s: path exists\n", options.serve);
+      return;
+    }
+    unlink(options.serve);
+  }
+  int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listener < 0 || bind(listener, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 || listen(listener, 16) != 0) {
+    fprintf(stderr, "Cannot listen on %s: %s\n", options.serve, strerror(errno));
+    return;
+  }
+  while (true) {
+    int fd = accept(listener, NULL, NULL);
+    if (fd < 0) {
+      if (errno == EINTR) continue;
+      fprintf(stderr, "accept failed: %s\n", strerror(errno));
+      return;
+    }
+    FILE *in = fdopen(fd, "r");
+    if (in == NULL) {
+      fprintf(stderr, "fdopen failed: %s\n", strerror(errno));
+      close(fd);
+      continue;
+    }
+    int out_fd = dup(fd);
+    FILE *out = out_fd >= 0 ? fdopen(out_fd, "w") : NULL;
+    if (out == NULL) {
+      fprintf(stderr, "fdopen failed: %s\n", strerror(errno));
+      if (out_fd >= 0) close(out_fd);
+      fclose(in);
+      continue;
+    }
+    serve_scenarios(in, out, options, pool, cache);
+    fclose(out);
+    fclose(in);
+  }
+}
+
+// Runs body, which performs `ops` operations of the given unit and returns a
+// checksum that keeps the compiler from optimizing the work away, and prints
+// how fast it was.
+template <class F>
+void bench(const char *name, long long ops, const char *unit, F body) {
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  long long checksum = body();
+  double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+  printf("%-22s %9.2f ns/%-5s %12.0f %ss/s  (checksum %lld)\n", name, 1e9 * seconds / ops, unit, ops / seconds, unit, checksum);
+}
+
+// Microbenchmarks of the simulation and annealing hot paths on the first board
+// an estimate without a cache would draw for the scenario, for comparing builds
+// and changes without timing a whole estimate.
+void run_benchmarks(const Scenario &scenario, const Options &options) {
+  Board board;
+  Estimate(scenario, &options, NULL, NULL).deal_board(&board);
+  // Draws the random data of the benchmarks below.
+  Twister twister;
+  twister.init(options.setup_seed);
+  const Deck &d1 = board.d1, &d2 = board.d2, &d3 = board.d3;
+  const Deck *decks[3] = {&d1, &d2, &d3};
+  unique_ptr<Worker> worker(new Worker);
+  atomic<bool> stop(false);
+
+  // A realistic play to start from: the best of a short annealing run.
+  SearchResult warmup;
+  Options warmup_options = options;
+  warmup_options.steps = 20000;
+  warmup_options.neighbors = 1;
+  worker->annealing_twister.init(options.annealing_seed);
+  worker->restart_seed = options.annealing_seed;
+  play_randomly(d1, d2, d3, warmup_options, &stop, &worker->annealing_twister, worker.get(), &warmup);
+  const State &best = warmup.best;
+  Checkpoint checkpoints[41];
+  checkpoints[0] = initial_checkpoint(d1, d2, d3);
+  State replayed;
+  replayed.play_out(d1, d2, d3, best, 0, checkpoints);
+  printf("Board 0 of the scenario, play to mutate: %d points in %d moves\n", best.points, best.move_sequence_sz);
+
+  // Bonuses met along the play.
+  const int cost_rounds = 5000;
+  bench("get_cost", (long long)cost_rounds * (best.move_sequence_sz + 1) * full_deck_size, "call", [&]() {
+    long long sum = 0;
+    for (int r = 0; r < cost_rounds; ++r) {
+      for (int k = 0; k <= best.move_sequence_sz; ++k) {
+        for (int id = 0; id < full_deck_size; ++id) sum += get_cost(id, checkpoints[k].bonus);
+      }
+    }
+    return sum;
+  });
+
+  // Random moves from the start, abandoned every 32 attempts.
+  char moves[4096];
+  for (int i = 0; i < 4096; ++i) moves[i] = twister.next_int(10);
+  const int process_calls = 20000000;
+  bench("Deck::process_move", process_calls, "call", [&]() {
+    long long sum = 0;
+    Checkpoint cp = checkpoints[0];
+    for (int i = 0; i < process_calls; ++i) {
+      int x = moves[i & 4095];
+      int d = x / 4;
+      sum += decks[d]->process_move(&cp.decks[d], x - 4 * d, &cp.points, &cp.tokens_cost, &cp.rounds, &cp.bonus, NULL);
+      if ((i & 31) == 31) cp = checkpoints[0];
+    }
+    return sum;
+  });
+
+  const int mutations = 10000000;
+  bench("State::mutate (mt)", mutations, "call", [&]() {
+    long long sum = 0;
+    for (int i = 0; i < mutations; ++i) {
+      State cand = best;
+      int pos;
+      if (cand.mutate(&twister, &pos)) sum += pos;
+    }
+    return sum;
+  });
+
+  // Neighbors of the play, resumed from their first change like annealing
+  // candidates.
+  const int neighbor_count = 1024;
+  vector<State> cands(neighbor_count, best);
+  vector<int> from(neighbor_count);
+  for (int i = 0; i < neighbor_count; ++i) {
+    while (!cands[i].mutate(&twister, &from[i])) {}
+  }
+  const int play_outs = 2000000;
+  bench("State::play_out", play_outs, "call", [&]() {
+    long long sum = 0;
+    State refined;
+    for (int i = 0; i < play_outs; ++i) {
+      int j = i & (neighbor_count - 1);
+      worker->candidate_checkpoints[from[j]] = checkpoints[from[j]];
+      refined.play_out(d1, d2, d3, cands[j], from[j], worker->candidate_checkpoints);
+      sum += refined.points;
+    }
+    return sum;
+  });
+
+  const int draws = 50000000;
+  bench("Twister::next_int", draws, "call", [&]() {
+    long long sum = 0;
+    for (int i = 0; i < draws; ++i) sum += twister.next_int(10);
+    return sum;
+  });
+  bench("Twister::next_float", draws, "call", [&]() {
+    double sum = 0;
+    for (int i = 0; i < draws; ++i) sum += twister.next_float();
+    return (long long)sum;
+  });
+  Xoshiro xoshiro;
+  xoshiro.init(options.annealing_seed);
+  bench("Xoshiro::next_int", draws, "call", [&]() {
+    long long sum = 0;
+    for (int i = 0; i < draws; ++i) sum += xoshiro.next_int(10);
+    return sum;
+  });
+  bench("Xoshiro::next_float", draws, "call", [&]() {
+    double sum = 0;
+    for (int i = 0; i < draws; ++i) sum += xoshiro.next_float();
+    return (long long)sum;
+  });
+
+  // Whole restarts as play_single_setting runs them, on one thread.
+  SearchResult result;
+  long long steps = (long long)options.restarts * options.steps;
+  bench("play_randomly", steps, "step", [&]() {
+    for (int i = 0; i < options.restarts; ++i) {
+      int seed = stream_seed(board.seed, i);
+      worker->restart_seed = seed;
+      if (options.xoshiro) {
+        worker->annealing_xoshiro.init(seed);
+        play_randomly(d1, d2, d3, options, &stop, &worker->annealing_xoshiro, worker.get(), &result);
+      } else {
+        worker->annealing_twister.init(seed);
+        play_randomly(d1, d2, d3, options, &stop, &worker->annealing_twister, worker.get(), &result);
+      }
+    }
+    return (long long)result.best.points;
+  });
+}
+
+#ifndef SPLENDOR_NO_MAIN
+int main(int argc, char **argv) {
+  Options options;
+  parse_flags(argc, argv, &options);
+
+  parse_full_deck();
+
+  if (options.bench) {
+    Scenario scenario;
+    LineReader reader(stdin);
+    string error;
+    read_scenario(&reader, false, &scenario, &error);
+    if (!error.empty()) {
+      fprintf(stderr, "%s\n", error.c_str());
+      return 1;
+    }
+    run_benchmarks(scenario, options);
+    return 0;
+  }
+
+  WorkerPool pool(options.threads > 0 ? options.threads : WorkerPool::default_size());
+  ResultCache cache;
+  if (options.cache != NULL && !cache.open(options.cache)) {
+    fprintf(stderr, "Cannot use %s as a result cache: it cannot be opened, is not a cache or is in use\n", options.cache);
+    return 1;
+  }
+  if (options.serve != NULL) {
+    serve(options, &pool, options.cache != NULL ? &cache : NULL);
+    return 1;
   }
-  printf("\n");
+  run_scenarios(stdin, stdout, options, &pool, options.cache != NULL ? &cache : NULL);
+  STAT(Stats stats;
+       for (int i = 0; i < pool.size(); ++i) stats.add(pool.worker(i).stats);
+       stats.print(stderr, options);)
 }
+#endif  // SPLENDOR_NO_MAIN